@@ -0,0 +1,30 @@
+#!/bin/sh
+# Compares the threaded dispatch loop against the portable switch loop.
+# Every program is run REPS times by each interpreter, the examples are small
+# so their timing includes the process start up.
+#
+# usage: sh bench/dispatch.sh [REPS]
+
+REPS=${1:-100}
+CC=${CC:-gcc}
+DIR=$(mktemp -d)
+
+$CC -O2 src/*.c -o $DIR/threaded -lm -pthread || exit 1
+$CC -O2 src/*.c -o $DIR/switch -lm -pthread -D USE_SWITCH_DISPATCH || exit 1
+
+run() {
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt $REPS ]; do
+		$1 -norepl $2 > /dev/null 2>&1
+		i=$((i +1))
+	done
+	echo $((($(date +%s%N) - start) / 1000000))
+}
+
+printf "%-28s %14s %14s\n" "program ($REPS runs)" "threaded (ms)" "switch (ms)"
+for prog in examples/*.prs bench/*.prs; do
+	printf "%-28s %14s %14s\n" $prog $(run $DIR/threaded $prog) $(run $DIR/switch $prog)
+done
+
+rm -r $DIR
@@ -17,688 +17,2579 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "parus.h"
+#include "parus_alloc.h"
+#include "parus_predefined.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
 
-// store the address of the base operator which called parus_apply
-static baseop_t apply_caller;
-
-// back door operation to implement base operators like apply top
-static applier_t apply_shortcut;
-
-// HELPERS
-// ----------------------------------------------------------------------------------------------------
+/*
+lexicon versions are unique across every lexicon, so a version also identifies the lexicon.
+threads take blocks of versions so they rarely touch the shared counter
+*/
+static atomic_size_t 			lexicon_versions;
+static _Thread_local size_t 	version_next;
+static _Thread_local size_t 	version_end;
 
-/* Copies the string, and insertes spaces between parentheses and quote and removes comments*/
-static char* copy_string(char* s) {
-	int size 	= 1;
-	int len 	= 1;
+static _Thread_local FILE* 		errors; // diagnostics of the thread, NULL for stderr
 
-	for (int i = 0; s[i] != '\0'; i++) {
-		if (s[i] == LP_CHAR || s[i] == RP_CHAR || s[i] == QUOTE_CHAR)
-			size += 2; // insert area for two spaces
-		size++;
-		len++;
-	}
+// symbols are interned in a single table shared by every lexicon, stack and thread
+static pthread_rwlock_t symbols_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-	char* ns = calloc(size, sizeof(char));
+static struct {
+	struct interned {
+		size_t 	hash;
+		char* 	name;
+	}* 		slots;
+	size_t 	max;
+	size_t 	size;
+} symbols;
 
-	for (int i = 0, j = 0; i < len; i++, j++) {
-		if (s[i] == COMMENT_CHAR) {
-			ns[j] = ' ';
-			while (s[i] != '\n' && s[i] != '\0') i++;
-		}
+// HELPERS
+// ----------------------------------------------------------------------------------------------------
 
-		if (s[i] == LP_CHAR || s[i] == RP_CHAR || s[i] == QUOTE_CHAR) {
-			ns[j++] = ' ';
-			ns[j++] = s[i];
-			ns[j] = ' ';
-		}
-		else
-			ns[j] = isspace(s[i]) ? ' ' : s[i];
+/* Returns a new lexicon version, versions are unique so they also identify user ops */
+static size_t next_version() {
+	if (version_next == version_end) {
+		version_next 	= atomic_fetch_add(&lexicon_versions, VERSION_BLOCK);
+		version_end 	= version_next + VERSION_BLOCK;
 	}
 
-	return ns;
+	return ++version_next; // 0 is never used
 }
 
-static char is_user_operator(char* s) {
-	return s != NULL && s[0] == LP_CHAR;
+/* Returns the stream diagnostics of the calling thread are written to, stderr by default */
+FILE* parus_errors() {
+	return errors != NULL ? errors : stderr;
 }
 
-static char is_termination(char* s) {
-	return s != NULL && s[0] == RP_CHAR;
+/* Redirects the diagnostics of the calling thread, NULL restores stderr */
+void parus_set_errors(FILE* f) {
+	errors = f;
 }
 
-static char is_integer(char* s) {
-	if (s == NULL || s[0] == '\0' || isspace(s[0]))
-		return 0;
-	char* p;
-	strtol(s, &p, 10);
-	return p[0] == '\0';
+enum token_kind {
+	TOKEN_END,
+	TOKEN_OPEN,
+	TOKEN_CLOSE,
+	TOKEN_QUOTE,
+	TOKEN_INTEGER,
+	TOKEN_DECIMAL,
+	TOKEN_SYMBOL
+};
+
+// a token refers to the source, nothing is copied
+struct token {
+	enum token_kind 	kind;
+	const char* 		start;
+	size_t 				length;
+	ParusData 			value; // parsed number
+};
+
+static char is_delimiter(char c) {
+	return isspace(c) || c == '\0' || c == LP_CHAR || c == RP_CHAR || c == QUOTE_CHAR || c == COMMENT_CHAR;
 }
 
-static char is_decimal(char* s) {
-	if (s == NULL || s[0] == '\0' || isspace(s[0])) 
-		return 0;
-	char* p;
-	strtod(s, &p);
-	return p[0] == '\0';
-}
+/*
+Classifies a word as a number and parses it in the same pass.
+integers are [+-]digits, decimals are [+-]digits[.digits][e[+-]digits] with at least one digit,
+an integer too large for integer_t is read as a decimal
+*/
+static enum token_kind scan_number(const char* s, size_t len, ParusData* value) {
+	size_t 		i 			= 0;
+	size_t 		digits 		= 0;
+	integer_t 	integer 	= 0;
+	char 		overflow 	= 0;
+	char 		negative 	= 0;
+
+	if (i < len && (s[i] == '+' || s[i] == '-'))
+		negative = s[i++] == '-';
+
+	for (; i < len && isdigit(s[i]); i++, digits++) {
+		integer_t d = s[i] - '0';
+		if (integer > (LONG_MAX - d) / 10)
+			overflow = 1;
+		else
+			integer = integer * 10 + d;
+	}
 
-static char is_quoted(char* s) {
-	return s != NULL && s[0] == QUOTE_CHAR;
-}
+	if (i == len && digits > 0 && !overflow) {
+		*value = make_parus_integer(negative ? -integer : integer);
+		return TOKEN_INTEGER;
+	}
 
-static char is_symbol(char* s) {
-	return s != NULL
-		&& !is_termination(s)
-		&& !is_user_operator(s)
-		&& !is_integer(s) 
-		&& !is_decimal(s) 
-		&& !is_quoted(s)
-		&& s[0] != '\0';
-}
+	if (i < len && s[i] == '.')
+		for (i++; i < len && isdigit(s[i]); i++, digits++);
 
-// PARUSDATA
-// ----------------------------------------------------------------------------------------------------
+	if (digits == 0)
+		return TOKEN_SYMBOL;
 
-/* Returns a new copy of ParusData* */
-ParusData* parusdata_copy(ParusData* original) {
-	if (original == NULL) return NULL;
+	if (i < len && (s[i] == 'e' || s[i] == 'E')) {
+		size_t exponent = 0;
+		i++;
+		if (i < len && (s[i] == '+' || s[i] == '-'))
+			i++;
+		for (; i < len && isdigit(s[i]); i++, exponent++);
+		if (exponent == 0)
+			return TOKEN_SYMBOL;
+	}
 
-	else if (original->type == INTEGER)
-		return make_parus_integer(parusdata_tointeger(original));
+	if (i != len)
+		return TOKEN_SYMBOL;
 
-	else if (original->type == DECIMAL)
-		return make_parus_decimal(parusdata_todecimal(original));
+	// the grammar is already checked, strtod only needs a terminated copy
+	char 	local[64];
+	char* 	copy = len < sizeof(local) ? local : malloc(len +1);
+	if (copy == NULL)
+		return TOKEN_SYMBOL;
 
-	else if (original->type == SYMBOL)
-		return make_parus_symbol(parusdata_getsymbol(original));
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	*value = make_parus_decimal(strtod(copy, NULL));
 
-	else if (original->type == QUOTED)
-		return make_parus_quote(parusdata_copy(parusdata_unquote(original)));
+	if (copy != local)
+		free(copy);
+	return TOKEN_DECIMAL;
+}
 
-	else if (original->type == BASEOP)
-		return make_parus_baseop(original->data.baseop);
+/* 
+Scans the next token of the source starting at *pos, and moves *pos past it.
+comment is set while the source ends inside a comment, so the next source continues skipping it
+*/
+static void next_token(const char* src, size_t len, size_t* pos, struct token* tok, char* comment) {
+	size_t i = *pos;
+
+	// skip spaces and comments
+	while (i < len) {
+		if (*comment) {
+			while (i < len && src[i] != '\n') i++;
+			*comment = i == len;
+		}
+		else if (src[i] == COMMENT_CHAR)
+			*comment = 1;
+		else if (isspace(src[i]) || src[i] == '\0')
+			i++;
+		else
+			break;
+	}
 
-	else if (original->type == USEROP) {
-		ParusData* op 	= calloc(1, sizeof(ParusData));
-		op->type 		= USEROP;
+	tok->start 	= src + i;
+	tok->length = 0;
 
-		op->data.userop.size 			= original->data.userop.size;
-		op->data.userop.instructions 	= calloc(op->data.userop.size, sizeof(ParusData));
+	if (i == len)
+		tok->kind = TOKEN_END;
 
-		for (int i = 0; i < op->data.userop.size; i++)
-			op->data.userop.instructions[i] = parusdata_copy(original->data.userop.instructions[i]);
+	else if (src[i] == LP_CHAR || src[i] == RP_CHAR || src[i] == QUOTE_CHAR) {
+		tok->kind 	= src[i] == LP_CHAR ? TOKEN_OPEN : src[i] == RP_CHAR ? TOKEN_CLOSE : TOKEN_QUOTE;
+		tok->length = 1;
+		i++;
+	}
+	else {
+		while (i < len && !is_delimiter(src[i]))
+			i++;
 
-		return op;
+		tok->length = src + i - tok->start;
+		tok->kind 	= scan_number(tok->start, tok->length, &tok->value);
 	}
 
-	return NULL;
+	*pos = i;
 }
 
-/* Makes a new parusdata as an integer */ 
-ParusData* make_parus_integer(integer_t i) {
-	ParusData* pd = calloc(1, sizeof(ParusData));
-	if (pd != NULL) {
-		pd->data.integer 	= i;
-		pd->type 			= INTEGER;
+// SYMBOLS
+// ----------------------------------------------------------------------------------------------------
+
+/* FNV-1a hash of a string */
+static size_t hash_string(const char* s, size_t len) {
+	size_t hash = 14695981039346656037UL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)s[i];
+		hash *= 1099511628211UL;
 	}
-	return pd;
+	return hash;
 }
 
-/* Returns an integer */
-integer_t parusdata_tointeger(ParusData* pd) {
-	return pd->data.integer;
-}
+/* Doubles the intern table and reinserts every symbol */
+static char grow_symbols() {
+	size_t 				max 	= symbols.max == 0 ? SYMBOLS_INITIAL : symbols.max * 2;
+	struct interned* 	slots 	= calloc(max, sizeof(struct interned));
 
-/* Makes a new parusdata as a decimal */ 
-ParusData* make_parus_decimal(decimal_t d) {
-	ParusData* pd = calloc(1, sizeof(ParusData));
-	if (pd != NULL) {
-		pd->data.decimal 	= d;
-		pd->type 			= DECIMAL;
+	if (slots == NULL)
+		return 0;
+
+	for (size_t i = 0; i < symbols.max; i++) {
+		if (symbols.slots[i].name == NULL)
+			continue;
+
+		size_t j = symbols.slots[i].hash & (max -1);
+		while (slots[j].name != NULL)
+			j = (j +1) & (max -1);
+
+		slots[j] = symbols.slots[i];
 	}
-	return pd;
+
+	free(symbols.slots);
+	symbols.slots 	= slots;
+	symbols.max 	= max;
+	return 1;
 }
 
-/* Returns a decimal */
-decimal_t parusdata_todecimal(ParusData* pd) {
-	return pd->data.decimal;
+/* Returns the interned copy of a name or the empty slot for it, the table must be locked */
+static struct interned* find_symbol(const char* s, size_t len, size_t hash) {
+	size_t i = hash & (symbols.max -1);
+
+	for (; symbols.slots[i].name != NULL; i = (i +1) & (symbols.max -1))
+		if (symbols.slots[i].hash == hash && strncmp(symbols.slots[i].name, s, len) == 0 
+				&& symbols.slots[i].name[len] == '\0')
+			break;
+
+	return &symbols.slots[i];
 }
 
-/* Makes a new parusdata as a symbol */ 
-ParusData* make_parus_symbol(char* s) {
-	ParusData* pd = calloc(1, sizeof(ParusData));
-	if (pd != NULL) {
-		pd->data.symbol 	= copy_string(s);
-		pd->type 			= SYMBOL;
+/*
+Returns the unique copy of a symbol name given by its first len characters.
+interned names are never freed and can be compared by their address
+*/
+char* parus_intern_n(const char* s, size_t len) {
+	size_t 	hash = hash_string(s, len);
+	char* 	name = NULL;
+
+	// most names are already interned, so they only need a shared lock
+	pthread_rwlock_rdlock(&symbols_lock);
+	if (symbols.max > 0)
+		name = find_symbol(s, len, hash)->name;
+	pthread_rwlock_unlock(&symbols_lock);
+
+	if (name != NULL)
+		return name;
+
+	pthread_rwlock_wrlock(&symbols_lock);
+
+	if (symbols.size * 4 >= symbols.max * 3 && !grow_symbols()) {
+		pthread_rwlock_unlock(&symbols_lock);
+		fprintf(parus_errors(), "CANNOT INTERN SYMBOL\n");
+		return NULL;
 	}
-	return pd;
-}
 
-/* Returns a symbol */
-char* parusdata_getsymbol(ParusData* pd) {
-	return pd->data.symbol;
-}
+	// another thread may have interned the name meanwhile
+	struct interned* slot = find_symbol(s, len, hash);
 
-/* Returns a new quoted value */
-ParusData* make_parus_quote(ParusData* quoted) {
-	ParusData* pd = calloc(1, sizeof(ParusData));
-	if (pd != NULL) {
-		pd->data.quoted = quoted;
-		pd->type 		= QUOTED;
+	if (slot->name == NULL && (name = malloc(len +1)) != NULL) {
+		memcpy(name, s, len);
+		name[len] 	= '\0';
+		slot->hash 	= hash;
+		slot->name 	= name;
+		symbols.size++;
 	}
-	return pd;
-}
 
-/* Returns the quoted ParusData* */
-ParusData* parusdata_unquote(ParusData* pd) {
-	return pd->data.quoted;
+	name = slot->name;
+	pthread_rwlock_unlock(&symbols_lock);
+
+	if (name == NULL)
+		fprintf(parus_errors(), "CANNOT INTERN SYMBOL\n");
+	return name;
 }
 
-/* Makes a new parusdata as a base operator */ 
-ParusData* make_parus_baseop(baseop_t op) {
-	ParusData* pd = calloc(1, sizeof(ParusData));
-	if (pd != NULL) {
-		pd->data.baseop 	= op;
-		pd->type 			= BASEOP;
-	}
-	return pd;
+/* Returns the unique copy of a symbol name */
+char* parus_intern(char* s) {
+	return parus_intern_n(s, strlen(s));
 }
 
-/* Makes a new userop insert instructions with parus_insert_instr */
-ParusData* make_parus_userop() {
-	ParusData* op = calloc(1, sizeof(ParusData));
+// FUSIONS
+// ----------------------------------------------------------------------------------------------------
+
+/*
+A fusion replaces a fixed sequence of words in a user op by a single native operation.
+the words must still be bound to the base operators they had when the fusion was defined,
+otherwise the original sequence is applied
+*/
+static struct fusion {
+	char* 		pattern;
+	int 		length;
+	struct {
+		char* 		name; // interned, NULL for an integer literal
+		baseop_t 	op;
+		char 		any; // the literal matches any integer and is given to the fused operation
+		integer_t 	value;
+	} words[FUSION_MAX_WORDS];
+
+	fusedop_t 	op;
+	char 		applies; // apply the top of the stack after the fused operation
+} fusions[FUSIONS_MAX];
+
+static int fusions_size;
 
-	if (op != NULL) {
-		op->data.userop.instructions	= calloc(USEROP_INSTR_GROWTH, sizeof(ParusData));
-		op->data.userop.max 			= USEROP_INSTR_GROWTH;
-		op->data.userop.size 			= 0;
-		op->type 						= USEROP;
+/*
+Defines a fused operation for a sequence of words separated by spaces.
+an integer in the pattern matches that literal, # matches any integer literal,
+any other word must name a predefined base operator
+*/
+void parus_define_fusion(char* pattern, fusedop_t op, char applies) {
+	for (int i = 0; i < fusions_size; i++)
+		if (strcmp(fusions[i].pattern, pattern) == 0)
+			return; // already defined
+
+	if (fusions_size == FUSIONS_MAX) {
+		fprintf(parus_errors(), "CANNOT DEFINE FUSION - %s\n", pattern);
+		return;
 	}
 
-	return op;
-}
+	struct fusion* f 	= &fusions[fusions_size];
+	char 	word[FUSION_MAX_WORD];
+	int 	i 			= 0;
+
+	f->length = 0;
+	while (pattern[i] != '\0') {
+		int len = 0;
+		while (pattern[i] == ' ')
+			i++;
+		while (pattern[i] != ' ' && pattern[i] != '\0' && len < FUSION_MAX_WORD -1)
+			word[len++] = pattern[i++];
+		word[len] = '\0';
+
+		if (len == 0)
+			break;
 
+		if (f->length == FUSION_MAX_WORDS) {
+			fprintf(parus_errors(), "CANNOT DEFINE FUSION - %s\n", pattern);
+			return;
+		}
 
-/* Free the parusdata */
-void free_parusdata(ParusData* pd) {
-	if (pd != NULL && pd->type != NONE) {
-		if (pd->type == SYMBOL)
-			free(pd->data.symbol);
+		char* 	end;
+		long 	value 	= strtol(word, &end, 10);
 
-		else if (pd->type == QUOTED)
-			free_parusdata((ParusData*)pd->data.quoted);
+		f->words[f->length].name 	= NULL;
+		f->words[f->length].op 		= NULL;
+		f->words[f->length].any 	= strcmp(word, "#") == 0;
+		f->words[f->length].value 	= value;
 
-		else if (pd->type == USEROP) {
-			for (int i = 0; i < pd->data.userop.size; i++) 
-				free_parusdata(pd->data.userop.instructions[i]);
+		if (!f->words[f->length].any && *end != '\0') {
+			baseop_t base = predefined_op(word);
+			if (base == NULL) {
+				fprintf(parus_errors(), "CANNOT DEFINE FUSION - %s\n", pattern);
+				return;
+			}
 
-			free(pd->data.userop.instructions);
-		}	
+			f->words[f->length].name 	= parus_intern(word);
+			f->words[f->length].op 		= base;
+		}
 
-		free(pd);
-		pd->type = NONE; // mark as cleaned
+		f->length++;
 	}
+
+	f->pattern 	= pattern;
+	f->op 		= op;
+	f->applies 	= applies;
+	fusions_size++;
 }
 
-/* Prints parusdata */
-void print_parusdata(ParusData* pd) {
-	if (pd == NULL) return;
+/* Prints how many times every fusion was applied by an interpreter */
+void print_fusions(FILE* f, ParusVM* vm) {
+	for (int i = 0; i < fusions_size; i++)
+		fprintf(f, "%s : %lu\n", fusions[i].pattern, (unsigned long)vm->fired[i]);
+}
 
-	if (pd->type == INTEGER) 
-		printf("%ld", parusdata_tointeger(pd));
+/* Returns the fusion matching the instructions starting at index, or -1 */
+static int match_fusion(struct userop* uop, int index) {
+	for (int f = 0; f < fusions_size; f++) {
+		if (index + fusions[f].length > uop->size)
+			continue;
 
-	else if (pd->type == DECIMAL)
-		printf("%f", parusdata_todecimal(pd));
+		int i = 0;
+		for (; i < fusions[f].length; i++) {
+			ParusData instr = uop->instructions[index + i];
 
-	else if (pd->type == SYMBOL)
-		printf("%s", parusdata_getsymbol(pd));
+			if (fusions[f].words[i].name != NULL) {
+				if (instr.type != SYMBOL || parusdata_getsymbol(instr) != fusions[f].words[i].name)
+					break;
+			}
+			else if (instr.type != INTEGER || 
+					(!fusions[f].words[i].any && parusdata_tointeger(instr) != fusions[f].words[i].value))
+				break;
+		}
 
-	else if (pd->type == QUOTED) {
-		printf("%c", QUOTE_CHAR);
-		print_parusdata(parusdata_unquote(pd));
+		if (i == fusions[f].length)
+			return f;
 	}
 
-	else
-		printf("parusdata@%x", pd);
+	return -1;
 }
 
-// STACK
+/* Returns if the words of a fusion are still bound to their base operators */
+static char fusion_valid(struct fusion* f, Lexicon* lex) {
+	for (int i = 0; i < f->length; i++) {
+		if (f->words[i].name == NULL)
+			continue;
+
+		struct binding* bnd = lexicon_lookup(lex, f->words[i].name);
+		if (bnd == NULL || bnd->value.type != BASEOP || bnd->value.data.baseop != f->words[i].op)
+			return 0;
+	}
+
+	return 1;
+}
+
+// COMPILER
 // ----------------------------------------------------------------------------------------------------
 
-/* Makes a new parus stack */
-Stack* make_stack() {
-	Stack* stk 	= calloc(1, sizeof(Stack*));
-	stk->size   = 0;
-	stk->max    = STACK_GROWTH;
-	stk->items  = calloc(stk->max, sizeof(ParusData));
+// the base operator which applies the top of the stack, the interpreter applies it in place
+static baseop_t apply_top_op;
 
-	return stk;
+/* Registers the base operator which applies the top of the stack, its calls do not nest */
+void parus_define_apply(baseop_t op) {
+	apply_top_op = op;
 }
 
-/* Pushes a new parusdata item to the stack */
-void stack_push(Stack* stk, ParusData* pd) {
-	if (stk->size != stk->max - 1) 
-		stk->items[stk->size++] = pd;
-	else {
-		stk->items = realloc(stk->items, (stk->max + STACK_GROWTH) * sizeof(ParusData*));
-		if (stk->items != 0) {
-			stk->max += STACK_GROWTH;
-			stk->items[stk->size++] = pd;
-		}
-		else
-			fprintf(stderr, "STACK OVERFLOW\n");
-	}
+// the word which binds locals and its base operator
+static char* 	let_name;
+static baseop_t let_op;
+
+/* Registers the word binding locals, 'name let in a user op is compiled to a slot while name is bound to op */
+void parus_define_let(char* name, baseop_t op) {
+	let_name 	= parus_intern(name);
+	let_op 		= op;
 }
 
-/*
-Pulls an item from the stack.
-the item needs to be freed after usage
+// the words around a case block and the base operator which ends it
+static char* 	case_begin;
+static char* 	case_end;
+static baseop_t case_op;
+
+/* 
+Registers the words of case blocks, a case block of literal pairs in a user op is compiled to conditional jumps
+while begin is bound to its own symbol and end to op
 */
-ParusData* stack_pull(Stack* stk) {
-	if (stk->size > 0)
-		return stk->items[--stk->size];
-	else {
-		fprintf(stderr, "STACK UNDERFLOW\n");
-		return NULL;
-	}
+void parus_define_case(char* begin, char* end, baseop_t op) {
+	case_begin 	= parus_intern(begin);
+	case_end 	= parus_intern(end);
+	case_op 	= op;
 }
 
-/*
-Gets a copy from the stack.
-index is counted from the end of the stack
-so 0 is the first item
-*/
-ParusData* stack_get_at(Stack* stk, size_t index) {
-	if (index < stk->size)
-		return parusdata_copy(stk->items[stk->size -(index +1)]);
-	else
-		return NULL;
+// the base operators of the loops run by the interpreter
+static baseop_t loop_ops[LOOP_UNTIL +1];
+
+/* Registers the base operator of a loop, applying it starts the loop in place instead of calling it */
+void parus_define_loop(enum loop_kind kind, baseop_t op) {
+	loop_ops[kind] = op;
+}
+
+/* Returns the kind of loop of a base operator, or -1 */
+static int loop_kind(baseop_t op) {
+	for (int k = 0; k <= LOOP_UNTIL; k++)
+		if (loop_ops[k] == op)
+			return k;
+
+	return -1;
 }
 
+/* Opcodes of compiled user operators */
+enum opcode {
+	OP_PUSH_INT, 	// push an integer
+	OP_PUSH_DEC, 	// push a decimal
+	OP_PUSH, 		// push a copy of a self evaluating instruction
+	OP_PUSH_QUOTE, 	// push a copy of the quoted value
+	OP_CALL_WORD, 	// resolve a symbol and apply its binding
+	OP_CALL_BASEOP, // call site whose binding was a base operator when it was resolved
+	OP_APPLY_TOP, 	// call site whose binding was the apply base operator when it was resolved
+	OP_TAILCALL, 	// resolve a symbol and apply its binding in place of the running operator
+	OP_LOCAL_GET, 	// apply a local, or the binding of its name while it is unset
+	OP_LOCAL_SET, 	// bind a local, followed by the let word which is applied if it was redefined
+	OP_FUSED, 		// fused operation, followed by the instructions it replaces
+	OP_CASE, 		// compiled case block, jumps to the instructions it replaces once its words were redefined
+	OP_CASE_APPLY, 	// apply a condition or an expression of a case block
+	OP_CASE_TEST, 	// pull a condition, jump to the next pair when it is false
+	OP_JUMP, 		// jump to the end of a case block
+	OP_LOOP, 		// run the next step of the innermost loop, only found in frames of loops
+	OP_RETURN 		// end of the operator
+};
+
 /*
-Deletes item from the stack an cleans it.
-index is counted from the end of the stack
-so 0 is the first item
+Call sites cache the binding they resolved together with the version of the lexicon,
+defining or deleting any entry changes the version so a stale cache is resolved again
 */
-void stack_remove_at(Stack* stk, size_t index) {
-	if (index < stk->size) {
-		ParusData* pd = stk->items[stk->size -(index +1)];
-		free_parusdata(pd);
-		for (int i = stk->size -(index +1); i < stk->size -1; i++)
-			stk->items[i] = stk->items[i +1];
+struct instr {
+	enum opcode 		op;
+	short 				fusion; // index of the fusion of a fused instruction
+	char 				valid; // if the fusion was valid at the cached version
+	void* 				label; // address of the opcode handler when threaded, NULL until then
+	ParusData 			operand; // borrowed from the instructions of the user op
+	struct binding* 	cache;
+	size_t 				version; // 0 when nothing is cached
+
+	int 				slot; // of a local
+	size_t 				owner; // id of the user op owning the local
+	int 				target; // offset of the instruction a jump goes to
+};
 
-		stk->size--;
-	}
+/*
+The dispatch loop is direct threaded with GCC's labels as values,
+every instruction jumps straight to the handler of the next one.
+compile with USE_SWITCH_DISPATCH, or a compiler without the extension, for a portable switch loop
+*/
+#if defined(__GNUC__) && !defined(USE_SWITCH_DISPATCH)
+
+#define THREADED_DISPATCH
+
+#define VM_DISPATCH(IP) 	goto *(IP)->label;
+#define VM_CASE(OP) 		label_##OP:
+#define VM_NEXT(IP) 		goto *(++(IP))->label
+#define VM_REWRITE(IP, OP) 	do { (IP)->op = OP; (IP)->label = labels[OP]; } while (0)
+#define VM_JUMP(IP, OP) 	goto label_##OP
+#define VM_GOTO(IP) 		goto *(IP)->label
+
+#else
+
+#define VM_DISPATCH(IP) 	dispatch: switch ((IP)->op)
+#define VM_CASE(OP) 		case OP:
+#define VM_NEXT(IP) 		do { (IP)++; goto dispatch; } while (0)
+#define VM_REWRITE(IP, OP) 	(IP)->op = OP
+#define VM_JUMP(IP, OP) 	goto dispatch
+#define VM_GOTO(IP) 		goto dispatch
+
+#endif
+
+/* Sets an instruction of compiled code */
+static void emit(struct instr* ip, enum opcode op, ParusData operand) {
+	ip->op 		= op;
+	ip->fusion 	= -1;
+	ip->valid 	= 0;
+	ip->label 	= NULL;
+	ip->operand = operand;
+	ip->cache 	= NULL;
+	ip->version = 0;
+	ip->slot 	= 0;
+	ip->owner 	= 0;
+	ip->target 	= 0;
 }
 
-/* Frees the stack */
-void free_stack(Stack* stk) {
-	if (stk != NULL) {
-		for (int i = 0; i < stk->size; i++)
-			free_parusdata(stk->items[i]);
-		free(stk->items);
-		free(stk);
-	}
+/* The locals of a user op being compiled, chained to the locals of the user ops around it */
+struct scope {
+	size_t 			id; // of the user op owning the locals
+	char** 			names; // room for every let of the user op
+	int 			size;
+	struct scope* 	outer;
+};
+
+/* Returns the name of the local bound by the instructions starting at index, as in 'name let, or NULL */
+static char* let_target(struct userop* uop, int index) {
+	if (let_name == NULL || index +1 >= uop->size)
+		return NULL;
+
+	ParusData name 	= uop->instructions[index];
+	ParusData word 	= uop->instructions[index +1];
+
+	if (name.type != QUOTED || parusdata_unquote(name).type != SYMBOL || 
+			word.type != SYMBOL || parusdata_getsymbol(word) != let_name || match_fusion(uop, index +1) >= 0)
+		return NULL;
+
+	return parusdata_getsymbol(parusdata_unquote(name));
 }
 
-/* Prints the stack contant */
-void print_stack(Stack* stk) {
-	for (int i = 0; i < stk->size; i++) {
-		print_parusdata(stk->items[i]);
-		printf(", ");
+/* Returns the scope of a local name and sets its slot, or NULL if the name is not local */
+static struct scope* find_local(struct scope* sc, char* name, int* slot) {
+	for (int depth = 0; sc != NULL && depth < SCOPES_MAX; sc = sc->outer, depth++)
+		for (int i = 0; i < sc->size; i++)
+			if (sc->names[i] == name) {
+				*slot = i;
+				return sc;
+			}
 
-	}
-	printf("\n");
+	return NULL;
 }
 
-// LEXICON
-// ----------------------------------------------------------------------------------------------------
+/* Returns the fusion starting at index, fusions whose words are local names do not apply */
+static int compile_fusion(struct userop* uop, int index, struct scope* sc) {
+	int f = match_fusion(uop, index);
+	int slot;
 
-/* Makes a new lexicon */
-Lexicon* make_lexicon() {
-	Lexicon* lex 	= calloc(1, sizeof(Lexicon));
-	lex->size 		= 0;
-	lex->max 		= LEXICON_GROWTH;
-	lex->entries 	= calloc(lex->max, sizeof(struct entry));
+	for (int i = 0; f >= 0 && i < fusions[f].length; i++)
+		if (fusions[f].words[i].name != NULL && find_local(sc, fusions[f].words[i].name, &slot) != NULL)
+			return -1;
 
-	return lex;
+	return f;
 }
 
-/* Define a new entry on the lexicon */
-void lexicon_define(Lexicon* lex, char* name, ParusData* pd) {
-	struct entry ent;
-	ent.name 	= copy_string(name);
-	ent.value 	= pd;
-	if (lex->size != lex->max - 1)
-		lex->entries[lex->size++] = ent;
-	else {
-		lex->entries = realloc(lex->entries, (lex->max + LEXICON_GROWTH) * sizeof(struct entry));
-		if (lex->entries != 0) {
-			lex->max += LEXICON_GROWTH;
-			lex->entries[lex->size++] = ent;
-		}
-		else
-			fprintf(stderr, "LEXICON OVERFLOW\n");
-	}
-}
+/* 
+Returns the number of pairs of the case block starting at index, or -1.
+only blocks made of literal values can be compiled, since their pairs are known before the user op runs
+*/
+static int match_case(struct userop* uop, int index, struct scope* sc) {
+	int slot;
 
-/* Deletes an entry from the lexicon */
-void lexicon_delete(Lexicon* lex, char* name) {
-	int index = 0;
-	for (int i = lex->size -1; i >= 0; i--) 
-		if (strcmp(lex->entries[i].name, name) == 0) {
-			index = i;
+	if (case_begin == NULL || uop->instructions[index].type != SYMBOL || 
+			parusdata_getsymbol(uop->instructions[index]) != case_begin || 
+			find_local(sc, case_begin, &slot) != NULL || find_local(sc, case_end, &slot) != NULL)
+		return -1;
 
-			free_parusdata(lex->entries[index].value);
-			free(lex->entries[index].name);
+	for (int i = index +1; i < uop->size; i++) {
+		ParusData instr = uop->instructions[i];
 
-			for (int i = index; i < lex->size; i++)
-				lex->entries[i] = lex->entries[i +1];
+		if (match_fusion(uop, i) >= 0)
+			return -1;
 
-			lex->size--;
-			
-			return;
-		}
-	
-	fprintf(stderr, "CANNOT DELETE AN UNDEFINED ENTRY - %s\n", name);
-}
+		if (instr.type == SYMBOL)
+			return parusdata_getsymbol(instr) == case_end && (i - index) % 2 == 1 && i - index > 1 ? (i - index) / 2 : -1;
 
-/* Gets a copy of an entry */
-ParusData* lexicon_get(Lexicon* lex, char* name) {
-	for (int i = lex->size -1; i >= 0; i--) 
-		if (strcmp(lex->entries[i].name, name) == 0)
-			return parusdata_copy(lex->entries[i].value);
+		if (instr.type != INTEGER && instr.type != DECIMAL && instr.type != QUOTED && instr.type != USEROP)
+			return -1;
+	}
 
-	fprintf(stderr, "UNDEFINED ENTRY - %s\n", name);
-	return NULL;
+	return -1;
 }
 
-/* Frees the lexicon */
-void free_lexicon(Lexicon* lex) {
-	if (lex != NULL) {
-		for (int i = 0; i < lex->size; i++) {
-			free_parusdata(lex->entries[i].value);
-			free(lex->entries[i].name);
-		}
-		free(lex->entries);
-		free(lex);
-	}
+/* Returns if the words of case blocks are still bound as they were registered */
+static char case_valid(Lexicon* lex) {
+	struct binding* begin 	= lexicon_lookup(lex, case_begin);
+	struct binding* end 	= lexicon_lookup(lex, case_end);
+
+	return begin != NULL && begin->value.type == QUOTED && parusdata_unquote(begin->value).type == SYMBOL && 
+			parusdata_getsymbol(parusdata_unquote(begin->value)) == case_begin && 
+			end != NULL && end->value.type == BASEOP && end->value.data.baseop == case_op;
 }
 
-/* Prints the lexicon contant */
-void print_lexicon(Lexicon* lex) {
-	for (int i = 0; i < lex->size; i++) {
-		printf("%s : ", lex->entries[i].name);
-		print_parusdata(lex->entries[i].value);
-		printf("\n");
-	}
+/* Sets an instruction applying a value of a case block, the value of a quote is what it would push */
+static void emit_case_value(struct instr* ip, ParusData value) {
+	if (value.type == INTEGER)
+		emit(ip, OP_PUSH_INT, value);
+	else if (value.type == DECIMAL)
+		emit(ip, OP_PUSH_DEC, value);
+	else
+		emit(ip, OP_CASE_APPLY, value.type == QUOTED ? parusdata_unquote(value) : value);
 }
 
-// CPARUS FUNCTIONS
-// ----------------------------------------------------------------------------------------------------
+/*
+Compiles a case block of pairs starting at index, returns the instructions after it.
+every pair is its condition, a test jumping to the next pair, its expression and a jump to the end of the block.
+the original words follow and are run instead once the words of case blocks were redefined
+*/
+static struct instr* compile_case(struct userop* uop, int index, int pairs, struct instr* ip) {
+	struct instr* 	start 		= ip;
+	struct instr* 	fallback 	= ip + 1 + pairs * 4;
+	struct instr* 	end 		= fallback + pairs * 2 +2;
 
-/* Inserts an instruction to a user op */
-void parus_insert_instr(ParusData* op, ParusData* instr) {
-	if (op->type != USEROP) {
-		fprintf(stderr, "CANNOT INSERT INSTRUCTION FOR A NON OPERATOR\n");
-		return;
-	}
-	
-	if (op->data.userop.size < op->data.userop.max -1)
-			op->data.userop.instructions[op->data.userop.size++] = instr;
-	
-	else {
-		op->data.userop.instructions = realloc(op->data.userop.instructions,
-					(op->data.userop.max + USEROP_INSTR_GROWTH) * sizeof(ParusData));
+	emit(ip, OP_CASE, make_parus_none());
+	ip->target = fallback - ip;
+	ip++;
 
-		if (op->data.userop.instructions != 0) {
-			op->data.userop.max += USEROP_INSTR_GROWTH;
-			op->data.userop.instructions[op->data.userop.size++] = instr;
-		}
-		else
-			fprintf(stderr, "CANNOT INSERT INSTRUCTION\n");
+	for (int p = 0; p < pairs; p++) {
+		emit_case_value(ip++, uop->instructions[index +1 + p * 2]);
+
+		emit(ip, OP_CASE_TEST, make_parus_none());
+		ip->target = (p == pairs -1 ? end : ip +3) - ip;
+		ip++;
+
+		emit_case_value(ip++, uop->instructions[index +2 + p * 2]);
+
+		emit(ip, OP_JUMP, make_parus_none());
+		ip->target = end - ip;
+		ip++;
 	}
+
+	return start + 1 + pairs * 4;
 }
 
-/* 
-Returns if the evaluator can call the expression by returning the parentheses count
+static int compile_userop(struct userop* uop, struct scope* outer);
 
-if result > 0 unterminated expression or standalone quote
-if result = 0 valid expression
-if result < 0 overterminated expression
+/*
+Compiles a user op written inside the code of another one so it can read the locals around it.
+a user op compiled for other locals may be running, it is replaced by a clone
 */
-int parus_parencount(char* expr) {
-	int 	result  = 0;
-	int 	i 		= 0;
-	char 	ignore  = 0;
-	char 	c;
-	char 	q 		= 0;
-
-	while ((c = expr[i++]) != '\0') {
-		if (c == COMMENT_CHAR)
-			ignore = 1;
-
-		else if (c == '\n')
-			ignore = 0;
+static void compile_nested(ParusData* instr, struct scope* sc) {
+	ParusData* op = instr->type == QUOTED ? &instr->data.quoted->value : instr;
+	if (op->type != USEROP)
+		return;
 
+	struct userop* 	uop 	= op->data.userop;
+	int 			depth 	= 0;
+	char 			same 	= uop->code != NULL;
 
-		if (c == QUOTE_CHAR)
-			q = 1;
+	for (struct scope* s = sc; s != NULL && depth < SCOPES_MAX; s = s->outer, depth++)
+		same = same && depth < uop->scopes_size && uop->scopes[depth] == s->id;
 
-		if (!ignore && c == LP_CHAR)
-			result++;
+	if (same && depth == uop->scopes_size)
+		return;
 
-		else if (!ignore && c == RP_CHAR)
-			result--;
+	if (uop->code != NULL) {
+		ParusData clone = parusdata_clone(*op);
+		if (clone.type != USEROP)
+			return;
 
-		if (!ignore && !isspace(c) && c != QUOTE_CHAR)
-			q = 0;
-	}   
+		free_parusdata(*op);
+		*op = clone;
+	}
 
-	if (q)
-		return 1;
-	return result;
+	compile_userop(op->data.userop, sc);
 }
 
-/*
-Sets apply_caller and apply_shortcut.
-make sure to call parus_set_applier(NULL, NULL), 
-after calling it in order to reset the values.
+/* 
+Compiles the instructions of a user op into an opcode stream.
+a fused instruction is placed before every sequence of words matching a fusion,
+'name let binds a local and reading name becomes an access to a slot of the frame of the user op.
+outer holds the locals of the user ops this one is written in, or NULL
+returns 0 on success
 */
-void parus_set_applier(baseop_t caller, applier_t applier) {
-	apply_caller 	= caller;
-	apply_shortcut	= applier;
-}
+static int compile_userop(struct userop* uop, struct scope* outer) {
+	struct scope sc = { uop->id, NULL, 0, outer };
+	int slot;
+	int lets = 0;
 
-/*
-Applies a parusdata 
-the function will automatically free pd if needed
-*/
-int parus_apply(ParusData* pd, Stack* stk, Lexicon* lex) {
-	static int call_depth = 0; // stores the call history
+	for (int i = 0; i < uop->size; i++)
+		if (let_target(uop, i) != NULL)
+			lets++;
 
-	if (call_depth > MAXIMUM_CALL_DEPTH) {
-		fprintf(stderr, "INSUFFICIENT DATA FOR MEANINGFUL ANSWER\n");
+	if (lets > 0 && (sc.names = parus_alloc(lets * sizeof(char*))) == NULL) {
+		fprintf(parus_errors(), "CANNOT COMPILE OPERATOR\n");
 		return 1;
 	}
 
-	// back door for base operators that use apply themselves
-	if (pd == NULL && apply_shortcut != NULL && apply_caller != NULL)
-		pd = apply_shortcut(stk, lex);
+	for (int i = 0; i < uop->size; i++) {
+		char* name = let_target(uop, i);
+		// a local of a user op around this one is set instead of being hidden
+		if (name != NULL && find_local(&sc, name, &slot) == NULL)
+			sc.names[sc.size++] = name;
+	}
 
-	recall:
+	struct scope* scope = sc.size > 0 ? &sc : outer;
 
-	if (pd == NULL || pd->type == NONE)
-		return 0;
+	int size = uop->size +1;
+	for (int i = 0; i < uop->size; i++) {
+		int f = compile_fusion(uop, i, scope);
+		int pairs;
 
-	if (pd->type == INTEGER || pd->type == DECIMAL) 
-		stack_push(stk, pd);
-	
-	else if (pd->type == SYMBOL) {
-		ParusData* binding = lexicon_get(lex, parusdata_getsymbol(pd));
-		free_parusdata(pd);
+		if (f >= 0) {
+			size++;
+			i += fusions[f].length -1;
+		}
+		else if ((pairs = match_case(uop, i, scope)) >= 0)
+			size += 1 + pairs * 4;
+	}
+
+	int depth = 0;
+	for (struct scope* s = outer; s != NULL && depth < SCOPES_MAX; s = s->outer)
+		depth++;
+
+	struct instr* 	code 	= parus_alloc(size * sizeof(struct instr));
+	size_t* 		scopes 	= depth > 0 ? parus_alloc(depth * sizeof(size_t)) : NULL;
+
+	if (code == NULL || (depth > 0 && scopes == NULL)) {
+		parus_free(code, size * sizeof(struct instr));
+		parus_free(scopes, depth * sizeof(size_t));
+		parus_free(sc.names, lets * sizeof(char*));
+		fprintf(parus_errors(), "CANNOT COMPILE OPERATOR\n");
+		return 1;
+	}
+
+	depth = 0;
+	for (struct scope* s = outer; s != NULL && depth < SCOPES_MAX; s = s->outer)
+		scopes[depth++] = s->id;
+
+	struct instr* 	ip 		= code;
+	int 			fused 	= 0; // instructions left in the current fused sequence
+
+	for (int i = 0; i < uop->size; i++, ip++) {
+		compile_nested(&uop->instructions[i], scope);
+
+		ParusData 		instr = uop->instructions[i];
+		struct scope* 	local = NULL;
+
+		int f, pairs;
+		if (fused == 0 && compile_fusion(uop, i, scope) < 0 && (pairs = match_case(uop, i, scope)) >= 0) {
+			// the values of the block are compiled first since the block borrows them
+			for (int j = 1; j <= pairs * 2; j++)
+				compile_nested(&uop->instructions[i + j], scope);
+
+			ip = compile_case(uop, i, pairs, ip);
+		}
+
+		if (fused == 0 && (f = compile_fusion(uop, i, scope)) >= 0) {
+			// the literal of the first # in the pattern is given to the fused operation
+			ParusData literal = make_parus_none();
+			for (int j = 0; j < fusions[f].length; j++)
+				if (fusions[f].words[j].any) {
+					literal = uop->instructions[i + j];
+					break;
+				}
+
+			emit(ip, OP_FUSED, literal);
+			ip->fusion 	= f;
+			fused 		= fusions[f].length;
+			ip++;
+		}
+		if (fused > 0)
+			fused--;
+
+		if (instr.type == INTEGER)
+			emit(ip, OP_PUSH_INT, instr);
+
+		else if (instr.type == DECIMAL)
+			emit(ip, OP_PUSH_DEC, instr);
+
+		else if (instr.type == SYMBOL && (local = find_local(scope, parusdata_getsymbol(instr), &slot)) != NULL) {
+			emit(ip, OP_LOCAL_GET, instr);
+			ip->slot 	= slot;
+			ip->owner 	= local->id;
+		}
+
+		else if (instr.type == SYMBOL)
+			emit(ip, i == uop->size -1 ? OP_TAILCALL : OP_CALL_WORD, instr);
+
+		else if (instr.type == QUOTED && let_target(uop, i) != NULL && 
+				(local = find_local(scope, let_target(uop, i), &slot)) != NULL) {
+			emit(ip, OP_LOCAL_SET, parusdata_unquote(instr));
+			ip->slot 	= slot;
+			ip->owner 	= local->id;
+		}
+
+		else if (instr.type == QUOTED)
+			emit(ip, OP_PUSH_QUOTE, parusdata_unquote(instr));
+
+		else
+			emit(ip, OP_PUSH, instr);
+	}
+
+	emit(ip, OP_RETURN, make_parus_none());
+
+	uop->code 			= code;
+	uop->code_size 		= size;
+	uop->locals 		= sc.size;
+	uop->scopes 		= scopes;
+	uop->scopes_size 	= depth;
+
+	parus_free(sc.names, lets * sizeof(char*));
+	return 0;
+}
+
+/* Returns the binding of a call site, the lexicon is searched only when it changed since the last call */
+static struct binding* resolve_call(struct instr* ip, Lexicon* lex) {
+	if (ip->version != lex->version) {
+		ip->cache 	= lexicon_lookup(lex, parusdata_getsymbol(ip->operand));
+		ip->version = lex->version;
+	}
+
+	if (ip->cache == NULL)
+		fprintf(parus_errors(), "UNDEFINED ENTRY - %s\n", parusdata_getsymbol(ip->operand));
+
+	return ip->cache;
+}
+
+/* Frees the compiled form of a user op, it is compiled again on its next application */
+static void free_code(struct userop* uop) {
+	parus_free(uop->code, uop->code_size * sizeof(struct instr));
+	parus_free(uop->scopes, uop->scopes_size * sizeof(size_t));
+	uop->code 			= NULL;
+	uop->code_size 		= 0;
+	uop->locals 		= 0;
+	uop->scopes 		= NULL;
+	uop->scopes_size 	= 0;
+}
+
+// PARUSDATA
+// ----------------------------------------------------------------------------------------------------
+
+/* 
+Returns a new reference to ParusData.
+quotes and userops are immutable once shared, so they are only reference counted
+*/
+ParusData parusdata_copy(ParusData original) {
+	if (original.type == QUOTED)
+		original.data.quoted->refs++;
+
+	else if (original.type == USEROP)
+		original.data.userop->refs++;
+
+	// integers, decimals, symbols and base operators are copied by value
+	return original;
+}
+
+/* 
+Returns a copy of pd that is not shared with any other reference, 
+pd is released, use it before mutating a quote or a userop 
+*/
+ParusData parusdata_unshare(ParusData pd) {
+	if (pd.type == QUOTED && pd.data.quoted->refs > 1) {
+		ParusData copy = make_parus_quote(parusdata_copy(parusdata_unquote(pd)));
+		free_parusdata(pd);
+		return copy;
+	}
+
+	else if (pd.type == USEROP && pd.data.userop->refs > 1) {
+		ParusData copy = make_parus_userop();
+
+		for (int i = 0; i < pd.data.userop->size; i++)
+			parus_insert_instr(&copy, parusdata_copy(pd.data.userop->instructions[i]));
+
+		free_parusdata(pd);
+		return copy;
+	}
+
+	return pd;
+}
+
+/* 
+Returns a deep copy of pd which shares no storage with it, the original is only read.
+reference counts and compiled code are not thread safe, values given to another thread are cloned
+*/
+ParusData parusdata_clone(ParusData pd) {
+	if (pd.type == QUOTED)
+		return make_parus_quote(parusdata_clone(parusdata_unquote(pd)));
+
+	else if (pd.type == USEROP) {
+		ParusData copy = make_parus_userop();
+
+		for (int i = 0; i < pd.data.userop->size; i++)
+			parus_insert_instr(&copy, parusdata_clone(pd.data.userop->instructions[i]));
+
+		return copy;
+	}
+
+	return pd;
+}
+
+/* Makes an empty parusdata */
+ParusData make_parus_none() {
+	ParusData pd;
+	pd.data.integer = 0;
+	pd.type 		= NONE;
+	return pd;
+}
+
+/* Makes a new parusdata as an integer */ 
+ParusData make_parus_integer(integer_t i) {
+	ParusData pd;
+	pd.data.integer 	= i;
+	pd.type 			= INTEGER;
+	return pd;
+}
+
+/* Returns an integer */
+integer_t parusdata_tointeger(ParusData pd) {
+	return pd.data.integer;
+}
+
+/* Makes a new parusdata as a decimal */ 
+ParusData make_parus_decimal(decimal_t d) {
+	ParusData pd;
+	pd.data.decimal 	= d;
+	pd.type 			= DECIMAL;
+	return pd;
+}
+
+/* Returns a decimal */
+decimal_t parusdata_todecimal(ParusData pd) {
+	return pd.data.decimal;
+}
+
+/* Makes a new parusdata as an interned symbol */ 
+ParusData make_parus_symbol(char* s) {
+	ParusData pd;
+	pd.data.symbol 	= parus_intern(s);
+	pd.type 		= pd.data.symbol != NULL ? SYMBOL : NONE;
+	return pd;
+}
+
+/* Returns a symbol */
+char* parusdata_getsymbol(ParusData pd) {
+	return pd.data.symbol;
+}
+
+/* Returns a new quoted value, the quoted value is kept on the heap */
+ParusData make_parus_quote(ParusData quoted) {
+	ParusData pd;
+	pd.data.quoted = parus_alloc(sizeof(struct quote));
+	if (pd.data.quoted != NULL) {
+		pd.data.quoted->value 	= quoted;
+		pd.data.quoted->refs 	= 1;
+		pd.type 				= QUOTED;
+	}
+	else {
+		free_parusdata(quoted);
+		pd.type = NONE;
+	}
+	return pd;
+}
+
+/* Returns the quoted ParusData, the result is still owned by pd */
+ParusData parusdata_unquote(ParusData pd) {
+	return pd.data.quoted->value;
+}
+
+/* Makes a new parusdata as a base operator */ 
+ParusData make_parus_baseop(baseop_t op) {
+	ParusData pd;
+	pd.data.baseop 	= op;
+	pd.type 		= BASEOP;
+	return pd;
+}
+
+/* Makes a new userop insert instructions with parus_insert_instr */
+ParusData make_parus_userop() {
+	ParusData op;
+	op.data.userop 	= parus_alloc(sizeof(struct userop));
+	op.type 		= NONE;
+
+	if (op.data.userop != NULL) {
+		op.data.userop->instructions	= parus_alloc(USEROP_INSTR_GROWTH * sizeof(ParusData));
+		op.data.userop->max 			= USEROP_INSTR_GROWTH;
+		op.data.userop->size 			= 0;
+		op.data.userop->refs 			= 1;
+		op.data.userop->code 			= NULL;
+		op.data.userop->code_size 		= 0;
+		op.data.userop->id 				= next_version();
+		op.data.userop->locals 			= 0;
+		op.data.userop->scopes 			= NULL;
+		op.data.userop->scopes_size 	= 0;
+		op.type 						= USEROP;
+	}
+
+	return op;
+}
+
+
+/* Releases a reference to the parusdata, the heap storage is freed with the last reference */
+void free_parusdata(ParusData pd) {
+	if (pd.type == QUOTED && --pd.data.quoted->refs == 0) {
+		free_parusdata(pd.data.quoted->value);
+		parus_free(pd.data.quoted, sizeof(struct quote));
+	}
+
+	else if (pd.type == USEROP && --pd.data.userop->refs == 0) {
+		for (int i = 0; i < pd.data.userop->size; i++) 
+			free_parusdata(pd.data.userop->instructions[i]);
+
+		free_code(pd.data.userop);
+		parus_free(pd.data.userop->instructions, pd.data.userop->max * sizeof(ParusData));
+		parus_free(pd.data.userop, sizeof(struct userop));
+	}	
+}
+
+/* Prints parusdata */
+void print_parusdata(FILE* f, ParusData pd) {
+	if (pd.type == INTEGER) 
+		fprintf(f, "%ld", parusdata_tointeger(pd));
+
+	else if (pd.type == DECIMAL)
+		fprintf(f, "%f", parusdata_todecimal(pd));
+
+	else if (pd.type == SYMBOL)
+		fprintf(f, "%s", parusdata_getsymbol(pd));
+
+	else if (pd.type == QUOTED) {
+		fprintf(f, "%c", QUOTE_CHAR);
+		print_parusdata(f, parusdata_unquote(pd));
+	}
+
+	else if (pd.type == USEROP)
+		fprintf(f, "parusdata@%lx", (unsigned long)pd.data.userop);
+
+	else if (pd.type == BASEOP)
+		fprintf(f, "parusdata@%lx", (unsigned long)pd.data.baseop);
+}
+
+// STACK
+// ----------------------------------------------------------------------------------------------------
+
+/* Makes a new parus stack */
+Stack* make_stack() {
+	Stack* stk 	= parus_alloc(sizeof(Stack));
+	stk->size   = 0;
+	stk->max    = STACK_GROWTH;
+	stk->items  = parus_alloc(stk->max * sizeof(ParusData));
+
+	return stk;
+}
+
+/* Pushes a new parusdata item to the stack */
+void stack_push(Stack* stk, ParusData pd) {
+	if (stk->size != stk->max - 1) 
+		stk->items[stk->size++] = pd;
+	else {
+		ParusData* items = parus_realloc(stk->items, stk->max * sizeof(ParusData), 
+				(stk->max + STACK_GROWTH) * sizeof(ParusData));
+		if (items != NULL) {
+			stk->items = items;
+			stk->max += STACK_GROWTH;
+			stk->items[stk->size++] = pd;
+		}
+		else {
+			free_parusdata(pd);
+			fprintf(parus_errors(), "STACK OVERFLOW\n");
+		}
+	}
+}
+
+/*
+Pulls an item from the stack.
+the item needs to be freed after usage
+*/
+ParusData stack_pull(Stack* stk) {
+	if (stk->size > 0)
+		return stk->items[--stk->size];
+	else {
+		fprintf(parus_errors(), "STACK UNDERFLOW\n");
+		return make_parus_none();
+	}
+}
+
+/*
+Gets a copy from the stack.
+index is counted from the end of the stack
+so 0 is the first item
+*/
+ParusData stack_get_at(Stack* stk, size_t index) {
+	if (index < stk->size)
+		return parusdata_copy(stk->items[stk->size -(index +1)]);
+	else
+		return make_parus_none();
+}
+
+/*
+Deletes item from the stack an cleans it.
+index is counted from the end of the stack
+so 0 is the first item
+*/
+void stack_remove_at(Stack* stk, size_t index) {
+	stack_remove_slice(stk, index, 1);
+}
+
+/*
+Moves a slice of count items out of the stack into items, the slice keeps its order and the stack no longer owns it.
+index is the depth of the topmost item of the slice, counted from the end of the stack as in stack_get_at.
+the items above the slice are shifted down at once, returns the number of items moved
+*/
+size_t stack_take_slice(Stack* stk, size_t index, size_t count, ParusData* items) {
+	if (index >= stk->size)
+		return 0;
+	if (count > stk->size - index)
+		count = stk->size - index;
+
+	size_t first = stk->size - index - count;
+
+	memcpy(items, &stk->items[first], count * sizeof(ParusData));
+	memmove(&stk->items[first], &stk->items[first + count], index * sizeof(ParusData));
+	stk->size -= count;
+	return count;
+}
+
+/* Deletes a slice of count items from the stack and cleans them, index is as in stack_take_slice */
+void stack_remove_slice(Stack* stk, size_t index, size_t count) {
+	if (index >= stk->size)
+		return;
+	if (count > stk->size - index)
+		count = stk->size - index;
+
+	size_t first = stk->size - index - count;
+
+	for (size_t i = first; i < first + count; i++)
+		free_parusdata(stk->items[i]);
+
+	memmove(&stk->items[first], &stk->items[first + count], index * sizeof(ParusData));
+	stk->size -= count;
+}
+
+/* Frees the stack */
+void free_stack(Stack* stk) {
+	if (stk != NULL) {
+		for (int i = 0; i < stk->size; i++)
+			free_parusdata(stk->items[i]);
+		parus_free(stk->items, stk->max * sizeof(ParusData));
+		parus_free(stk, sizeof(Stack));
+	}
+}
+
+/* Prints the stack contant */
+void print_stack(FILE* f, Stack* stk) {
+	for (int i = 0; i < stk->size; i++) {
+		print_parusdata(f, stk->items[i]);
+		fprintf(f, ", ");
+
+	}
+	fprintf(f, "\n");
+}
+
+// LEXICON
+// ----------------------------------------------------------------------------------------------------
+
+/* Hashes the address of an interned name */
+static size_t hash_name(char* name) {
+	return ((size_t)name >> 3) * 11400714819323198485UL;
+}
+
+/* Returns the slot of name, or the empty slot it would be placed in */
+static struct entry* lexicon_slot(Lexicon* lex, char* name) {
+	size_t i = (hash_name(name) >> 32) & (lex->max -1);
+
+	while (lex->entries[i].name != NULL && lex->entries[i].name != name)
+		i = (i +1) & (lex->max -1);
+
+	return &lex->entries[i];
+}
+
+/* Doubles the lexicon and reinserts its names */
+static char lexicon_grow(Lexicon* lex) {
+	struct entry* 	old 	= lex->entries;
+	size_t 			old_max = lex->max;
+	struct entry* 	entries = parus_alloc(old_max * 2 * sizeof(struct entry));
+
+	if (entries == NULL)
+		return 0;
+
+	memset(entries, 0, old_max * 2 * sizeof(struct entry));
+	lex->entries 	= entries;
+	lex->max 		= old_max * 2;
+
+	for (size_t i = 0; i < old_max; i++)
+		if (old[i].name != NULL)
+			*lexicon_slot(lex, old[i].name) = old[i];
+
+	parus_free(old, old_max * sizeof(struct entry));
+	return 1;
+}
+
+/* Makes a new lexicon */
+Lexicon* make_lexicon() {
+	Lexicon* lex 	= parus_alloc(sizeof(Lexicon));
+	lex->size 		= 0;
+	lex->max 		= LEXICON_INITIAL;
+	lex->entries 	= parus_alloc(lex->max * sizeof(struct entry));
+	memset(lex->entries, 0, lex->max * sizeof(struct entry));
+	lex->version 	= next_version();
+
+	lex->trail 		= NULL;
+	lex->trail_size = 0;
+	lex->trail_max 	= 0;
+	lex->marks 		= NULL;
+	lex->marks_size = 0;
+	lex->marks_max 	= 0;
+
+	return lex;
+}
+
+/* Defines the bindings of an entry in a lexicon, oldest first */
+static void copy_bindings(Lexicon* lex, char* name, struct binding* bnd, ParusData (*copy)(ParusData)) {
+	if (bnd != NULL) {
+		copy_bindings(lex, name, bnd->shadowed, copy);
+		lexicon_define(lex, name, (*copy)(bnd->value));
+	}
+}
+
+/* Makes a copy of a lexicon, shadowed bindings included. values are shared with the original */
+Lexicon* lexicon_copy(Lexicon* lex) {
+	Lexicon* copy = make_lexicon();
+
+	for (size_t i = 0; i < lex->max; i++)
+		if (lex->entries[i].name != NULL)
+			copy_bindings(copy, lex->entries[i].name, lex->entries[i].binding, &parusdata_copy);
+
+	return copy;
+}
+
+/* Makes a copy of a lexicon whose values are cloned, see parusdata_clone */
+Lexicon* lexicon_clone(Lexicon* lex) {
+	Lexicon* copy = make_lexicon();
+
+	for (size_t i = 0; i < lex->max; i++)
+		if (lex->entries[i].name != NULL)
+			copy_bindings(copy, lex->entries[i].name, lex->entries[i].binding, &parusdata_clone);
+
+	return copy;
+}
+
+/* 
+Define a new entry on the lexicon, name must be interned.
+the new binding shadows the previous bindings of the name until it is deleted
+*/
+void lexicon_define(Lexicon* lex, char* name, ParusData pd) {
+	if (lex->size * 4 >= lex->max * 3 && !lexicon_grow(lex)) {
+		free_parusdata(pd);
+		fprintf(parus_errors(), "LEXICON OVERFLOW\n");
+		return;
+	}
+
+	struct binding* bnd = parus_alloc(sizeof(struct binding));
+	if (bnd == NULL) {
+		free_parusdata(pd);
+		fprintf(parus_errors(), "LEXICON OVERFLOW\n");
+		return;
+	}
+
+	struct entry* ent = lexicon_slot(lex, name);
+	if (ent->name == NULL) {
+		ent->name 		= name;
+		ent->binding 	= NULL;
+		lex->size++;
+	}
+
+	bnd->value 		= pd;
+	bnd->shadowed 	= ent->binding;
+	ent->binding 	= bnd;
+	lex->version 	= next_version();
+	bnd->version 	= lex->version;
+
+	if (lex->marks_size > 0) {
+		if (lex->trail_size == lex->trail_max) {
+			struct trail* trail = parus_realloc(lex->trail, lex->trail_max * sizeof(struct trail), 
+					(lex->trail_max + TRAIL_GROWTH) * sizeof(struct trail));
+
+			if (trail == NULL) {
+				fprintf(parus_errors(), "LEXICON OVERFLOW\n");
+				return;
+			}
+			lex->trail 		= trail;
+			lex->trail_max += TRAIL_GROWTH;
+		}
+		lex->trail[lex->trail_size].name 		= name;
+		lex->trail[lex->trail_size].version 	= bnd->version;
+		lex->trail_size++;
+	}
+}
+
+/* Empties the slot of an entry without bindings, the entries after it are shifted back to keep their probe sequences */
+static void lexicon_vacate(Lexicon* lex, struct entry* ent) {
+	size_t i = ent - lex->entries;
+	size_t j = i;
+
+	for (;;) {
+		j = (j +1) & (lex->max -1);
+		if (lex->entries[j].name == NULL)
+			break;
+
+		size_t home = (hash_name(lex->entries[j].name) >> 32) & (lex->max -1);
+
+		// the entry at j may move to i unless its home slot is cyclically in (i, j]
+		if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+			lex->entries[i] = lex->entries[j];
+			i = j;
+		}
+	}
+
+	lex->entries[i].name 	= NULL;
+	lex->entries[i].binding = NULL;
+	lex->size--;
+}
+
+/* Deletes the latest binding of an entry from the lexicon, name must be interned */
+void lexicon_delete(Lexicon* lex, char* name) {
+	struct entry* ent = lexicon_slot(lex, name);
+
+	if (ent->name != NULL && ent->binding != NULL) {
+		struct binding* bnd = ent->binding;
+		ent->binding 		= bnd->shadowed;
+
+		// redefining in a loop deletes the latest definition, so the trail does not grow.
+		// only definitions made since the innermost mark are popped, the ones below it belong to outer marks
+		if (lex->marks_size > 0 && lex->trail_size > lex->marks[lex->marks_size -1] && 
+				lex->trail[lex->trail_size -1].version == bnd->version)
+			lex->trail_size--;
+
+		free_parusdata(bnd->value);
+		parus_free(bnd, sizeof(struct binding));
+
+		if (ent->binding == NULL)
+			lexicon_vacate(lex, ent);
+
+		lex->version = next_version();
+		return;
+	}
+	
+	fprintf(parus_errors(), "CANNOT DELETE AN UNDEFINED ENTRY - %s\n", name);
+}
+
+/* 
+Marks the lexicon and returns the mark.
+from then on definitions are recorded until the lexicon is rolled back to the mark, marks may be nested
+*/
+size_t lexicon_mark(Lexicon* lex) {
+	if (lex->marks_size == lex->marks_max) {
+		size_t* marks = parus_realloc(lex->marks, lex->marks_max * sizeof(size_t), 
+				(lex->marks_max + TRAIL_GROWTH) * sizeof(size_t));
+
+		if (marks == NULL) {
+			fprintf(parus_errors(), "LEXICON OVERFLOW\n");
+			return lex->marks_size;
+		}
+		lex->marks 		= marks;
+		lex->marks_max += TRAIL_GROWTH;
+	}
+
+	lex->marks[lex->marks_size] = lex->trail_size;
+	return lex->marks_size++;
+}
+
+/* 
+Deletes every binding defined since a mark, the mark and the marks set after it are released.
+bindings that were already deleted are skipped, bindings older than the mark are kept.
+returns 0 if the mark is set
+*/
+int lexicon_rollback(Lexicon* lex, size_t mark) {
+	if (mark >= lex->marks_size) {
+		fprintf(parus_errors(), "CANNOT ROLLBACK TO AN UNKNOWN MARK\n");
+		return 1;
+	}
+
+	size_t base = lex->marks[mark];
+
+	// newer bindings of a name are recorded after older ones, so a binding is at the top of its name once reached
+	while (lex->trail_size > base) {
+		struct trail* 	tr 	= &lex->trail[--lex->trail_size];
+		struct entry* 	ent = lexicon_slot(lex, tr->name);
+
+		if (ent->name == NULL || ent->binding == NULL || ent->binding->version != tr->version)
+			continue;
+
+		struct binding* bnd = ent->binding;
+		ent->binding 		= bnd->shadowed;
+		free_parusdata(bnd->value);
+		parus_free(bnd, sizeof(struct binding));
+
+		if (ent->binding == NULL)
+			lexicon_vacate(lex, ent);
+	}
+
+	lex->marks_size = mark;
+	lex->version 	= next_version();
+	return 0;
+}
+
+/* 
+Returns the latest binding of name or NULL, name must be interned.
+the binding is valid as long as the version of the lexicon is unchanged
+*/
+struct binding* lexicon_lookup(Lexicon* lex, char* name) {
+	return lexicon_slot(lex, name)->binding;
+}
+
+/* Gets a copy of an entry, name must be interned */
+ParusData lexicon_get(Lexicon* lex, char* name) {
+	struct binding* bnd = lexicon_lookup(lex, name);
+
+	if (bnd != NULL)
+		return parusdata_copy(bnd->value);
+
+	fprintf(parus_errors(), "UNDEFINED ENTRY - %s\n", name);
+	return make_parus_none();
+}
+
+/* Frees the lexicon */
+void free_lexicon(Lexicon* lex) {
+	if (lex != NULL) {
+		for (size_t i = 0; i < lex->max; i++) {
+			struct binding* bnd = lex->entries[i].name != NULL ? lex->entries[i].binding : NULL;
+
+			while (bnd != NULL) {
+				struct binding* shadowed = bnd->shadowed;
+				free_parusdata(bnd->value);
+				parus_free(bnd, sizeof(struct binding));
+				bnd = shadowed;
+			}
+		}
+		parus_free(lex->entries, lex->max * sizeof(struct entry));
+		parus_free(lex->trail, lex->trail_max * sizeof(struct trail));
+		parus_free(lex->marks, lex->marks_max * sizeof(size_t));
+		parus_free(lex, sizeof(Lexicon));
+	}
+}
+
+/* Prints the lexicon contant, shadowed bindings are printed after the binding that hides them */
+void print_lexicon(FILE* f, Lexicon* lex) {
+	for (size_t i = 0; i < lex->max; i++) {
+		if (lex->entries[i].name == NULL)
+			continue;
+
+		for (struct binding* bnd = lex->entries[i].binding; bnd != NULL; bnd = bnd->shadowed) {
+			fprintf(f, "%s : ", lex->entries[i].name);
+			print_parusdata(f, bnd->value);
+			fprintf(f, "\n");
+		}
+	}
+}
+
+// CPARUS FUNCTIONS
+// ----------------------------------------------------------------------------------------------------
+
+/* 
+Moves a slice of the stack to the end of a user op as its instructions, index is as in stack_take_slice.
+the user op grows once and the slice is moved without copying its values
+*/
+void parus_insert_slice(ParusData* op, Stack* stk, size_t index, size_t count) {
+	if (op->type != USEROP) {
+		fprintf(parus_errors(), "CANNOT INSERT INSTRUCTION FOR A NON OPERATOR\n");
+		stack_remove_slice(stk, index, count);
+		return;
+	}
+
+	*op = parusdata_unshare(*op);
+	struct userop* uop = op->data.userop;
+
+	if (uop->code != NULL)
+		free_code(uop);
+
+	if (uop->size + count >= uop->max) {
+		size_t 		max 			= uop->size + count + USEROP_INSTR_GROWTH;
+		ParusData* 	instructions 	= parus_realloc(uop->instructions, uop->max * sizeof(ParusData), 
+				max * sizeof(ParusData));
+
+		if (instructions == NULL) {
+			fprintf(parus_errors(), "CANNOT INSERT INSTRUCTION\n");
+			stack_remove_slice(stk, index, count);
+			return;
+		}
+		uop->instructions 	= instructions;
+		uop->max 			= max;
+	}
+
+	uop->size += stack_take_slice(stk, index, count, &uop->instructions[uop->size]);
+}
+
+/* Inserts an instruction to a user op, a shared user op is copied first */
+void parus_insert_instr(ParusData* op, ParusData instr) {
+	if (op->type != USEROP) {
+		fprintf(parus_errors(), "CANNOT INSERT INSTRUCTION FOR A NON OPERATOR\n");
+		free_parusdata(instr);
+		return;
+	}
+
+	*op = parusdata_unshare(*op);
+	struct userop* uop = op->data.userop;
+
+	if (uop->code != NULL)
+		free_code(uop);
+	
+	if (uop->size < uop->max -1)
+		uop->instructions[uop->size++] = instr;
+	
+	else {
+		ParusData* instructions = parus_realloc(uop->instructions, uop->max * sizeof(ParusData), 
+				(uop->max + USEROP_INSTR_GROWTH) * sizeof(ParusData));
+
+		if (instructions != NULL) {
+			uop->instructions = instructions;
+			uop->max += USEROP_INSTR_GROWTH;
+			uop->instructions[uop->size++] = instr;
+		}
+		else {
+			free_parusdata(instr);
+			fprintf(parus_errors(), "CANNOT INSERT INSTRUCTION\n");
+		}
+	}
+}
+
+/* 
+Returns if the evaluator can call the expression by returning the parentheses count
+
+if result > 0 unterminated expression or standalone quote
+if result = 0 valid expression
+if result < 0 overterminated expression
+*/
+int parus_parencount(char* expr) {
+	int 	result  = 0;
+	int 	i 		= 0;
+	char 	ignore  = 0;
+	char 	c;
+	char 	q 		= 0;
+
+	while ((c = expr[i++]) != '\0') {
+		if (c == COMMENT_CHAR)
+			ignore = 1;
+
+		else if (c == '\n')
+			ignore = 0;
+
+
+		if (c == QUOTE_CHAR)
+			q = 1;
+
+		if (!ignore && c == LP_CHAR)
+			result++;
+
+		else if (!ignore && c == RP_CHAR)
+			result--;
+
+		if (!ignore && !isspace(c) && c != QUOTE_CHAR)
+			q = 0;
+	}   
+
+	if (q)
+		return 1;
+	return result;
+}
+
+/* Makes an interpreter with an empty stack, the interpreter owns the lexicon */
+ParusVM* make_parus_vm(Lexicon* lex) {
+	ParusVM* vm = malloc(sizeof(ParusVM));
+	if (vm == NULL) {
+		fprintf(parus_errors(), "CANNOT ALLOCATE INTERPRETER\n");
+		return NULL;
+	}
+
+	vm->stack 			= make_stack();
+	vm->lexicon 		= lex;
+	vm->apply_caller 	= NULL;
+	vm->apply_shortcut 	= NULL;
+	vm->call_depth 		= 0;
+	vm->frames 			= NULL;
+	vm->frames_size 	= 0;
+	vm->frames_max 		= 0;
+	vm->frames_limit 	= MAXIMUM_FRAMES_MEMORY;
+	vm->slots 			= NULL;
+	vm->slots_size 		= 0;
+	vm->slots_max 		= 0;
+	vm->windows 		= NULL;
+	vm->windows_size 	= 0;
+	vm->windows_max 	= 0;
+	vm->loops 			= NULL;
+	vm->loops_size 		= 0;
+	vm->loops_max 		= 0;
+	vm->out 			= stdout;
+	vm->pooled 			= 0;
+	vm->halted 			= 0;
+	memset(vm->fired, 0, sizeof(vm->fired));
+	return vm;
+}
+
+/* Frees the interpreter with its stack and lexicon */
+void free_parus_vm(ParusVM* vm) {
+	if (vm != NULL) {
+		free_stack(vm->stack);
+		free_lexicon(vm->lexicon);
+		for (size_t i = 0; i < vm->slots_size; i++)
+			free_parusdata(vm->slots[i]);
+
+		free(vm->frames);
+		free(vm->slots);
+		free(vm->windows);
+		free(vm->loops);
+		free(vm);
+	}
+}
+
+/*
+Sets apply_caller and apply_shortcut.
+make sure to call parus_set_applier(vm, NULL, NULL), 
+after calling it in order to reset the values.
+*/
+void parus_set_applier(ParusVM* vm, baseop_t caller, applier_t applier) {
+	vm->apply_caller 	= caller;
+	vm->apply_shortcut	= applier;
+}
+
+/* Pushes the frame of the running user op, returns 0 when the frames would exceed their memory limit */
+static char push_frame(ParusVM* vm, ParusData op, struct instr* ip, size_t windows) {
+	if (vm->frames_size == vm->frames_max) {
+		size_t max = vm->frames_max == 0 ? FRAMES_INITIAL : vm->frames_max * 2;
+		if (max * sizeof(struct frame) > vm->frames_limit)
+			max = vm->frames_limit / sizeof(struct frame);
+
+		struct frame* frames = max > vm->frames_max ? realloc(vm->frames, max * sizeof(struct frame)) : NULL;
+		if (frames == NULL)
+			return 0;
+
+		vm->frames 		= frames;
+		vm->frames_max 	= max;
+	}
+
+	vm->frames[vm->frames_size].op 		= op;
+	vm->frames[vm->frames_size].ip 		= ip;
+	vm->frames[vm->frames_size].windows = windows;
+	vm->frames_size++;
+	return 1;
+}
+
+/* Pushes a window of unset locals for a user op, returns 0 if there is no memory left */
+static char push_window(ParusVM* vm, struct userop* uop) {
+	if (vm->windows_size == vm->windows_max) {
+		size_t 			max 	= vm->windows_max == 0 ? FRAMES_INITIAL : vm->windows_max * 2;
+		struct window* 	windows = realloc(vm->windows, max * sizeof(struct window));
+		if (windows == NULL)
+			return 0;
+
+		vm->windows 	= windows;
+		vm->windows_max = max;
+	}
+
+	if (vm->slots_size + uop->locals > vm->slots_max) {
+		size_t max = vm->slots_max == 0 ? FRAMES_INITIAL : vm->slots_max * 2;
+		while (max < vm->slots_size + uop->locals)
+			max *= 2;
+
+		ParusData* slots = realloc(vm->slots, max * sizeof(ParusData));
+		if (slots == NULL)
+			return 0;
+
+		vm->slots 		= slots;
+		vm->slots_max 	= max;
+	}
+
+	struct window* w = &vm->windows[vm->windows_size++];
+	w->id 	= uop->id;
+	w->base = vm->slots_size;
+	w->size = uop->locals;
+
+	for (int i = 0; i < uop->locals; i++)
+		vm->slots[vm->slots_size++] = make_parus_none();
+
+	return 1;
+}
+
+/* Releases the latest window of locals */
+static void pop_window(ParusVM* vm) {
+	struct window* w = &vm->windows[--vm->windows_size];
+
+	while (vm->slots_size > w->base)
+		free_parusdata(vm->slots[--vm->slots_size]);
+}
+
+/*
+Releases the windows above windows that a user op taking the place of their owner does not read,
+the windows of the user ops it is written in stay until it returns
+*/
+static void release_unread(ParusVM* vm, size_t windows, struct userop* uop) {
+	while (vm->windows_size > windows) {
+		size_t 	id 		= vm->windows[vm->windows_size -1].id;
+		char 	read 	= 0;
+
+		for (int i = 0; i < uop->scopes_size && !read; i++)
+			read = uop->scopes[i] == id;
+
+		if (read)
+			break;
+
+		pop_window(vm);
+	}
+}
+
+/* Returns the slot of a local in the latest window of its user op, or NULL when it does not run */
+static ParusData* local_slot(ParusVM* vm, struct instr* ip) {
+	for (size_t w = vm->windows_size; w > 0; w--)
+		if (vm->windows[w -1].id == ip->owner)
+			return &vm->slots[vm->windows[w -1].base + ip->slot];
+
+	return NULL;
+}
+
+/* Starts a loop with its parameters from the stack, returns 0 if they are wrong */
+static char start_loop(ParusVM* vm, enum loop_kind kind) {
+	ParusData body 	= stack_pull(vm->stack);
+	ParusData cond 	= make_parus_none();
+	ParusData min 	= make_parus_integer(0);
+	ParusData max 	= make_parus_integer(0);
+
+	if (kind == LOOP_WHILE || kind == LOOP_UNTIL)
+		cond = stack_pull(vm->stack);
+	else
+		max = stack_pull(vm->stack);
+
+	if (kind == LOOP_RANGE)
+		min = stack_pull(vm->stack);
+
+	if (body.type == NONE || min.type != INTEGER || max.type != INTEGER || 
+			((kind == LOOP_WHILE || kind == LOOP_UNTIL) && cond.type == NONE)) {
+
+		fprintf(parus_errors(), "WRONG TYPES OF PARAMETERS GIVEN\n");
+		fprintf(parus_errors(), kind == LOOP_TIMES ? "COUNT FN\n" : kind == LOOP_RANGE ? "MIN MAX FN\n" : "COND FN\n");
+		free_parusdata(body);
+		free_parusdata(cond);
+		free_parusdata(min);
+		free_parusdata(max);
+		return 0;
+	}
+
+	if (vm->loops_size == vm->loops_max) {
+		size_t 			max_loops 	= vm->loops_max == 0 ? FRAMES_INITIAL : vm->loops_max * 2;
+		struct loop* 	loops 		= realloc(vm->loops, max_loops * sizeof(struct loop));
+
+		if (loops == NULL) {
+			fprintf(parus_errors(), "INSUFFICIENT DATA FOR MEANINGFUL ANSWER\n");
+			free_parusdata(body);
+			free_parusdata(cond);
+			return 0;
+		}
+		vm->loops 		= loops;
+		vm->loops_max 	= max_loops;
+	}
+
+	struct loop* l 	= &vm->loops[vm->loops_size++];
+	l->kind 		= kind;
+	l->testing 		= 0;
+	l->body 		= body;
+	l->cond 		= cond;
+	l->index 		= parusdata_tointeger(min);
+	l->end 			= parusdata_tointeger(max);
+	return 1;
+}
+
+/* Releases the innermost loop */
+static void end_loop(ParusVM* vm) {
+	struct loop* l = &vm->loops[--vm->loops_size];
+	free_parusdata(l->body);
+	free_parusdata(l->cond);
+}
+
+/*
+Applies a parusdata 
+the function will automatically free pd if needed.
+calls between user ops push a frame on the heap instead of recursing,
+only base operators which apply values themselves nest on the C stack
+*/
+int parus_apply(ParusVM* vm, ParusData pd) {
+	Stack* 			stk 	= vm->stack;
+	Lexicon* 		lex 	= vm->lexicon;
+	size_t 			base 	= vm->frames_size; // frames below belong to enclosing applications
+	size_t 			first 	= vm->windows_size;
+	size_t 			windows = first; // windows of locals below the ones of the running operator
+	size_t 			loops 	= vm->loops_size;
+	struct instr* 	ip;
+
+	#ifdef THREADED_DISPATCH
+	static void* const labels[] = {
+		[OP_PUSH_INT] 	= &&label_OP_PUSH_INT,
+		[OP_PUSH_DEC] 	= &&label_OP_PUSH_DEC,
+		[OP_PUSH] 		= &&label_OP_PUSH,
+		[OP_PUSH_QUOTE] = &&label_OP_PUSH_QUOTE,
+		[OP_CALL_WORD] 	= &&label_OP_CALL_WORD,
+		[OP_CALL_BASEOP]= &&label_OP_CALL_BASEOP,
+		[OP_APPLY_TOP] 	= &&label_OP_APPLY_TOP,
+		[OP_TAILCALL] 	= &&label_OP_TAILCALL,
+		[OP_LOCAL_GET] 	= &&label_OP_LOCAL_GET,
+		[OP_LOCAL_SET] 	= &&label_OP_LOCAL_SET,
+		[OP_FUSED] 		= &&label_OP_FUSED,
+		[OP_CASE] 		= &&label_OP_CASE,
+		[OP_CASE_APPLY] = &&label_OP_CASE_APPLY,
+		[OP_CASE_TEST] 	= &&label_OP_CASE_TEST,
+		[OP_JUMP] 		= &&label_OP_JUMP,
+		[OP_LOOP] 		= &&label_OP_LOOP,
+		[OP_RETURN] 	= &&label_OP_RETURN
+	};
+
+	// frames of loops resume here, it is never written
+	static struct instr loop_step = { .op = OP_LOOP, .label = &&label_OP_LOOP };
+	#else
+	static struct instr loop_step = { .op = OP_LOOP };
+	#endif
+
+	// a halted interpreter applies nothing until its evaluation ends
+	if (vm->halted) {
+		free_parusdata(pd);
+		return 1;
+	}
+
+	if (vm->call_depth > MAXIMUM_CALL_DEPTH) {
+		fprintf(parus_errors(), "INSUFFICIENT DATA FOR MEANINGFUL ANSWER\n");
+		free_parusdata(pd);
+		return 1;
+	}
+	vm->call_depth++;
+
+	// back door for base operators that use apply themselves
+	if (pd.type == NONE && vm->apply_shortcut != NULL && vm->apply_caller != NULL)
+		pd = vm->apply_shortcut(vm);
+
+	recall:
+
+	if (pd.type == NONE)
+		goto resume;
+
+	if (pd.type == INTEGER || pd.type == DECIMAL) 
+		stack_push(stk, pd);
+	
+	else if (pd.type == SYMBOL) {
+		ParusData binding = lexicon_get(lex, parusdata_getsymbol(pd));
+		free_parusdata(pd);
 		pd = binding;
 
 		goto recall;
 	}
 
-	else if (pd->type == QUOTED) {
-		ParusData* unquoted = parusdata_copy(parusdata_unquote(pd));
+	else if (pd.type == QUOTED) {
+		ParusData unquoted = parusdata_copy(parusdata_unquote(pd));
 		stack_push(stk, unquoted);
 		free_parusdata(pd);
 	}
 
-	else if (pd->type == BASEOP) {
+	else if (pd.type == BASEOP) {
+		// the top of the stack replaces the apply operator, which makes ! in tail position a tail call
+		if (pd.data.baseop == apply_top_op) {
+			pd = stack_pull(stk);
+			goto recall;
+		}
+
+		// loops are run by the interpreter, their body is applied like any call
+		int kind = loop_kind(pd.data.baseop);
+		if (kind >= 0) {
+			if (!start_loop(vm, kind)) {
+				fprintf(parus_errors(), "ERROR\n");
+				goto resume;
+			}
+
+			pd = make_parus_none();
+			ip = &loop_step;
+			VM_GOTO(ip);
+		}
+
 		// dont allow mutual recursion between applier and parus_apply
-		if (apply_caller != pd->data.baseop) {
-			int result = (*pd->data.baseop)(stk, lex);
+		if (vm->apply_caller != pd.data.baseop) {
+			int result = (*pd.data.baseop)(vm);
+			if (result && vm->halted)
+				goto failed;
 			if (result)
-				fprintf(stderr, "ERROR\n");
-
-			free_parusdata(pd);
+				fprintf(parus_errors(), "ERROR\n");
 		}
 		else {
-			if (apply_shortcut != NULL) {
-				free_parusdata(pd);
-				pd = (*apply_shortcut)(stk, lex);
+			if (vm->apply_shortcut != NULL) {
+				pd = (*vm->apply_shortcut)(vm);
 				goto recall;
 			}
 		}
 	}
 
-	else if (pd->type == USEROP) {
+	else if (pd.type == USEROP) {
+		struct userop* uop = pd.data.userop;
 
-		if (pd->data.userop.size == 0) {
+		if (uop->code == NULL && compile_userop(uop, NULL) != 0) {
 			free_parusdata(pd);
-			return 0;
+			goto failed;
+		}
+
+		// in place of an operator, only the locals it was written in are kept
+		if (vm->windows_size > windows)
+			release_unread(vm, windows, uop);
+
+		if (uop->locals > 0 && !push_window(vm, uop)) {
+			fprintf(parus_errors(), "INSUFFICIENT DATA FOR MEANINGFUL ANSWER\n");
+			free_parusdata(pd);
+			goto failed;
 		}
 
-		// do all the instruction in the operator except the last instruction
-		for (int i = 0; i < pd->data.userop.size -1; i++) {
+		ip = uop->code;
+
+		// thread the code on its first run
+		#ifdef THREADED_DISPATCH
+		if (ip->label == NULL)
+			for (int i = 0; i < uop->code_size; i++)
+				ip[i].label = labels[ip[i].op];
+		#endif
+
+		VM_DISPATCH(ip) {
+			VM_CASE(OP_PUSH_INT)
+			VM_CASE(OP_PUSH_DEC)
+				stack_push(stk, ip->operand);
+				VM_NEXT(ip);
+
+			VM_CASE(OP_PUSH)
+			VM_CASE(OP_PUSH_QUOTE)
+				stack_push(stk, parusdata_copy(ip->operand));
+				VM_NEXT(ip);
+
+			VM_CASE(OP_CALL_BASEOP) {
+				// base operators are called directly unless they are the running applier
+				if (ip->version == lex->version && ip->cache->value.data.baseop != vm->apply_caller) {
+					if ((*ip->cache->value.data.baseop)(vm)) {
+						// quit halted the interpreter, every running operator ends
+						if (vm->halted) {
+							free_parusdata(pd);
+							goto failed;
+						}
+						fprintf(parus_errors(), "ERROR\n");
+					}
+					VM_NEXT(ip);
+				}
+
+				VM_REWRITE(ip, OP_CALL_WORD);
+				VM_JUMP(ip, OP_CALL_WORD);
+			}
+
+			VM_CASE(OP_APPLY_TOP) {
+				if (ip->version != lex->version) {
+					VM_REWRITE(ip, OP_CALL_WORD);
+					VM_JUMP(ip, OP_CALL_WORD);
+				}
+
+				ParusData top = stack_pull(stk);
+
+				// followed by the end of the operator, the applied value replaces it
+				if ((ip +1)->op == OP_RETURN) {
+					free_parusdata(pd);
+					pd = top;
+					goto recall;
+				}
+
+				if (!push_frame(vm, pd, ip +1, windows)) {
+					fprintf(parus_errors(), "INSUFFICIENT DATA FOR MEANINGFUL ANSWER\n");
+					free_parusdata(top);
+					free_parusdata(pd);
+					goto failed;
+				}
+
+				windows = vm->windows_size;
+				pd 		= top;
+				goto recall;
+			}
+
+			VM_CASE(OP_CALL_WORD) {
+				struct binding* bnd = resolve_call(ip, lex);
+				if (bnd == NULL) 
+					VM_NEXT(ip);
+
+				if (bnd->value.type == BASEOP && bnd->value.data.baseop == apply_top_op) {
+					VM_REWRITE(ip, OP_APPLY_TOP);
+					VM_JUMP(ip, OP_APPLY_TOP);
+				}
+
+				if (bnd->value.type == BASEOP && loop_kind(bnd->value.data.baseop) < 0) {
+					VM_REWRITE(ip, OP_CALL_BASEOP);
+					if (bnd->value.data.baseop != vm->apply_caller) {
+						if ((*bnd->value.data.baseop)(vm)) {
+							if (vm->halted) {
+								free_parusdata(pd);
+								goto failed;
+							}
+							fprintf(parus_errors(), "ERROR\n");
+						}
+						VM_NEXT(ip);
+					}
+				}
+
+				// the running operator resumes after the call
+				if (!push_frame(vm, pd, ip +1, windows)) {
+					fprintf(parus_errors(), "INSUFFICIENT DATA FOR MEANINGFUL ANSWER\n");
+					free_parusdata(pd);
+					goto failed;
+				}
+
+				windows = vm->windows_size;
+				pd 		= parusdata_copy(bnd->value);
+				goto recall;
+			}
+
+			VM_CASE(OP_TAILCALL) {
+				struct binding* bnd = resolve_call(ip, lex);
+				ParusData binding 	= bnd != NULL ? parusdata_copy(bnd->value) : make_parus_none();
+				free_parusdata(pd);
+				pd = binding;
+
+				goto recall;
+			}
+
+			VM_CASE(OP_LOCAL_GET) {
+				ParusData* 	slot = local_slot(vm, ip);
+				ParusData 	value;
+
+				if (slot != NULL && (slot->type == INTEGER || slot->type == DECIMAL)) {
+					stack_push(stk, *slot);
+					VM_NEXT(ip);
+				}
+
+				if (slot != NULL && slot->type != NONE)
+					value = parusdata_copy(*slot);
+				else {
+					struct binding* bnd = resolve_call(ip, lex);
+					if (bnd == NULL)
+						VM_NEXT(ip);
+					value = parusdata_copy(bnd->value);
+				}
+
+				if ((ip +1)->op == OP_RETURN) {
+					free_parusdata(pd);
+					pd = value;
+					goto recall;
+				}
+
+				if (!push_frame(vm, pd, ip +1, windows)) {
+					fprintf(parus_errors(), "INSUFFICIENT DATA FOR MEANINGFUL ANSWER\n");
+					free_parusdata(value);
+					free_parusdata(pd);
+					goto failed;
+				}
+
+				windows = vm->windows_size;
+				pd 		= value;
+				goto recall;
+			}
+
+			VM_CASE(OP_LOCAL_SET) {
+				struct instr* 	let = ip +1;
+				ParusData* 		slot;
+
+				if (let->version != lex->version) {
+					let->cache 		= lexicon_lookup(lex, let_name);
+					let->version 	= lex->version;
+				}
+
+				if (let->cache != NULL && let->cache->value.type == BASEOP && let->cache->value.data.baseop == let_op &&
+						(slot = local_slot(vm, ip)) != NULL) {
+
+					ParusData value = stack_pull(stk);
+					if (value.type == NONE)
+						fprintf(parus_errors(), "NOTHING TO BIND TO %s\n", parusdata_getsymbol(ip->operand));
+
+					free_parusdata(*slot);
+					*slot 	= value;
+					ip 		+= 2;
+					VM_GOTO(ip);
+				}
+
+				// let was redefined, the name is pushed and the word is applied as written
+				stack_push(stk, ip->operand);
+				VM_NEXT(ip);
+			}
+
+			VM_CASE(OP_FUSED) {
+				struct fusion* f = &fusions[ip->fusion];
+
+				if (ip->version != lex->version) {
+					ip->valid 	= fusion_valid(f, lex);
+					ip->version = lex->version;
+				}
+
+				int e;
+				if (!ip->valid || (e = (*f->op)(vm, ip->operand)) < 0)
+					VM_NEXT(ip); // apply the original words
+
+				if (e)
+					fprintf(parus_errors(), "ERROR\n");
+
+				vm->fired[ip->fusion]++;
+				ip += f->length +1;
+
+				if (f->applies) {
+					ParusData top = stack_pull(stk);
+
+					// in tail position the applied value replaces the running operator
+					if (ip->op == OP_RETURN) {
+						free_parusdata(pd);
+						pd = top;
+						goto recall;
+					}
+
+					if (!push_frame(vm, pd, ip, windows)) {
+						fprintf(parus_errors(), "INSUFFICIENT DATA FOR MEANINGFUL ANSWER\n");
+						free_parusdata(top);
+						free_parusdata(pd);
+						goto failed;
+					}
+
+					windows = vm->windows_size;
+					pd 		= top;
+					goto recall;
+				}
+
+				VM_GOTO(ip);
+			}
+
+			VM_CASE(OP_CASE) {
+				if (ip->version != lex->version) {
+					ip->valid 	= case_valid(lex);
+					ip->version = lex->version;
+				}
+
+				// the original words are applied once case or end-case was redefined
+				ip += ip->valid ? 1 : ip->target;
+				VM_GOTO(ip);
+			}
+
+			VM_CASE(OP_CASE_APPLY) {
+				ParusData 		value 	= parusdata_copy(ip->operand);
+				struct instr* 	next 	= ip +1;
 
-			// if not self evaluating instruction then apply it
-			ParusData* instr = pd->data.userop.instructions[i];
-			if (instr->type == SYMBOL || instr->type == QUOTED) {
+				if (next->op == OP_JUMP)
+					next += next->target;
 
-				call_depth++;
-				int e = parus_apply(parusdata_copy(instr), stk, lex);
-				call_depth--;
+				// an expression at the end of the operator replaces it
+				if (next->op == OP_RETURN) {
+					free_parusdata(pd);
+					pd = value;
+					goto recall;
+				}
 
-				if (e) {
+				if (!push_frame(vm, pd, ip +1, windows)) {
+					fprintf(parus_errors(), "INSUFFICIENT DATA FOR MEANINGFUL ANSWER\n");
+					free_parusdata(value);
 					free_parusdata(pd);
-					return 1;
+					goto failed;
+				}
+
+				windows = vm->windows_size;
+				pd 		= value;
+				goto recall;
+			}
+
+			VM_CASE(OP_CASE_TEST) {
+				ParusData cond = stack_pull(stk);
+
+				if ((cond.type == INTEGER && parusdata_tointeger(cond) == 0) || 
+						(cond.type == DECIMAL && parusdata_todecimal(cond) == 0)) {
+					ip += ip->target;
+					VM_GOTO(ip);
+				}
+
+				free_parusdata(cond);
+				VM_NEXT(ip);
+			}
+
+			VM_CASE(OP_JUMP)
+				ip += ip->target;
+				VM_GOTO(ip);
+
+			VM_CASE(OP_LOOP) {
+				struct loop* 	l 		= &vm->loops[vm->loops_size -1];
+				ParusData 		next 	= l->body;
+				char 			more;
+
+				if (l->kind == LOOP_WHILE || l->kind == LOOP_UNTIL) {
+					l->testing = !l->testing;
+
+					if (l->testing) {
+						next = l->cond;
+						more = 1;
+					}
+					else {
+						ParusData cond = stack_pull(stk);
+						char holds = !((cond.type == INTEGER && parusdata_tointeger(cond) == 0) || 
+								(cond.type == DECIMAL && parusdata_todecimal(cond) == 0));
+
+						more = cond.type != NONE && holds == (l->kind == LOOP_WHILE);
+						free_parusdata(cond);
+					}
+				}
+				else {
+					more = l->index < l->end;
+					if (more && l->kind == LOOP_RANGE)
+						stack_push(stk, make_parus_integer(l->index));
+					l->index++;
+				}
+
+				if (!more) {
+					end_loop(vm);
+					goto resume;
 				}
+
+				if (!push_frame(vm, make_parus_none(), ip, windows)) {
+					fprintf(parus_errors(), "INSUFFICIENT DATA FOR MEANINGFUL ANSWER\n");
+					goto failed;
+				}
+
+				windows = vm->windows_size;
+				pd 		= parusdata_copy(next);
+				goto recall;
 			}
-			else 
-				stack_push(stk, parusdata_copy(instr));
+
+			VM_CASE(OP_RETURN)
+				free_parusdata(pd);
+				goto resume;
 		}
+	}
 
-		ParusData* 	last	= pd->data.userop.instructions[pd->data.userop.size -1];
-		ParusData* 	next_pd	= parusdata_copy(last);
+	resume:
 
-		free_parusdata(pd);
-		pd = next_pd;
+	while (vm->windows_size > windows)
+		pop_window(vm);
 
-		if (pd != NULL && (pd->type == SYMBOL || pd->type == QUOTED))
-			goto recall;
-		else
-			stack_push(stk, pd);
+	// continue the operator which made the call
+	if (vm->frames_size > base) {
+		vm->frames_size--;
+		pd 		= vm->frames[vm->frames_size].op;
+		ip 		= vm->frames[vm->frames_size].ip;
+		windows = vm->frames[vm->frames_size].windows;
+		VM_GOTO(ip);
 	}
 
+	vm->call_depth--;
 	return 0;
+
+	failed:
+
+	// an error aborts every operator of this application
+	while (vm->frames_size > base)
+		free_parusdata(vm->frames[--vm->frames_size].op);
+
+	while (vm->windows_size > first)
+		pop_window(vm);
+
+	while (vm->loops_size > loops)
+		end_loop(vm);
+
+	vm->call_depth--;
+	return 1;
 }
 
-/* The Parus Evaluator */
-void parus_evaluate(char* expr, Stack* stk, Lexicon* lex) {
-	char* 	buffer 	= copy_string(expr);
-	char* 	token 	= strtok(buffer, " ");
+/* Makes a stream evaluated by an interpreter, a stream without an interpreter only keeps forms */
+ParusStream* make_parus_stream(ParusVM* vm) {
+	ParusStream* ps = malloc(sizeof(ParusStream));
+	if (ps == NULL) {
+		fprintf(parus_errors(), "CANNOT ALLOCATE STREAM\n");
+		return NULL;
+	}
+
+	ps->vm 		= vm;
+	ps->forms 	= NULL;
+	ps->opstk 	= make_stack();
+	ps->qtstk 	= make_stack();
+	ps->word 	= NULL;
+	ps->size 	= 0;
+	ps->max 	= 0;
+	ps->comment = 0;
+	ps->failed 	= 0;
+	return ps;
+}
 
+/* Evaluates a single token, after a failure the rest of the stream is ignored */
+static void stream_token(ParusStream* ps, struct token* token) {
 	// stacks are used to store yet to be terminated operators and quotes
-	Stack* 	opstk 	= make_stack(); 
-	Stack* 	qtstk 	= make_stack();
+	Stack* 		opstk 	= ps->opstk;
+	Stack* 		qtstk 	= ps->qtstk;
+	ParusData 	pd 		= make_parus_none();
 	
-	while (token != NULL) {
-		ParusData* pd = NULL;
-		
-		if (is_termination(token)) {
-			if (opstk->size > 0) {
-				if (qtstk->size != 0 && (pd = stack_pull(qtstk)) != NULL) {
-					free_parusdata(pd);
-					fprintf(stderr, "INVALID INSRUCTION GIVEN - STANDALONE QUOTE\n");
-					break;
-				}
-
-				pd = stack_pull(opstk);
+	if (token->kind == TOKEN_CLOSE) {
+		if (opstk->size > 0) {
+			if (qtstk->size != 0 && (pd = stack_pull(qtstk)).type != NONE) {
+				fprintf(parus_errors(), "INVALID INSRUCTION GIVEN - STANDALONE QUOTE\n");
+				ps->failed = 1;
+				return;
 			}
-			else {
-				fprintf(stderr, "INVALID EXPRESSION GIVEN - EXPECTED AN OPERATOR\n");
-				break;
+
+			// user ops written inside it are compiled with it, as they may read its locals
+			pd = stack_pull(opstk);
+			if (opstk->size == 0 && compile_userop(pd.data.userop, NULL) != 0) {
+				free_parusdata(pd);
+				ps->failed = 1;
+				return;
 			}
 		}
+		else {
+			fprintf(parus_errors(), "INVALID EXPRESSION GIVEN - EXPECTED AN OPERATOR\n");
+			ps->failed = 1;
+			return;
+		}
+	}
+
+	/* self evaluating forms */
+	else if (token->kind == TOKEN_OPEN) {
+		stack_push(opstk, make_parus_userop());
+		stack_push(qtstk, make_parus_none()); // keep bookmark of the quotation order
+	}
 
-		/* self evaluating forms */
-		else if (is_user_operator(token)) {
-			stack_push(opstk, make_parus_userop());
-			stack_push(qtstk, NULL); // keep bookmark of the quotation order
+	else if (token->kind == TOKEN_INTEGER || token->kind == TOKEN_DECIMAL)
+		pd = token->value;
+
+	/* quoted forms, the quote marker is an integer that is never dereferenced */
+	else if (token->kind == TOKEN_QUOTE)
+		stack_push(qtstk, make_parus_integer(QUOTE_CHAR));
+	
+	/* calls */
+	else {
+		pd.data.symbol 	= parus_intern_n(token->start, token->length);
+		pd.type 		= pd.data.symbol != NULL ? SYMBOL : NONE;
+	}
+
+	// if a complete expression is yet to be read continue
+	if (pd.type == NONE) return;
+
+	// quotates the expression
+	while (qtstk->size > 0) {
+		if (qtstk->items[qtstk->size -1].type != NONE) {
+			stack_pull(qtstk);
+			pd = make_parus_quote(pd);
 		}
+		else 
+			break; // reached a bookmark
+	}
 
-		else if (is_integer(token))
-			pd = make_parus_integer(atoi(token));
+	if (opstk->size == 0) {
+		if (ps->forms != NULL)
+			stack_push(ps->forms, pd); // kept to be evaluated later
+		else if (pd.type != SYMBOL && pd.type != QUOTED) 
+			stack_push(ps->vm->stack, pd); // self evaluating, push to the stack
+		else
+			parus_apply(ps->vm, pd); // non self evaluating, apply
 
-		else if (is_decimal(token))
-			pd = make_parus_decimal(atof(token));
+		if (ps->vm != NULL && ps->vm->halted)
+			ps->failed = 1;
+	}
+	else // inserts instruction to top most operator
+		parus_insert_instr(&opstk->items[opstk->size -1], pd);
+}
 
-		/* quoted forms */
-		else if (is_quoted(token))
-			stack_push(qtstk, make_parus_quote(NULL));
-		
-		/* calls */
-		else if (is_symbol(token))
-			pd = make_parus_symbol(token);
-		
-		// validate expression
-		if ((token = strtok(NULL, " ")) == NULL) { 
-			// if nothing to quote
-			if (qtstk->size > 0 && qtstk->items[qtstk->size -1] != NULL && pd == NULL) { 
-				fprintf(stderr, "INVALID EXPRESSION GIVEN - STANDALONE QUOTE\n");
-				free_parusdata(pd);
-				break;
-			}
-			if (opstk->size > 0) { // if unterminated expression given
-				fprintf(stderr, "INVALID EXPRESSION GIVEN - UNTERMINATED OPERATOR\n");
-				free_parusdata(pd);
-				break;
-			}
+/* Evaluates the word kept from the previous chunk */
+static void stream_word(ParusStream* ps) {
+	struct token token;
+
+	token.start 	= ps->word;
+	token.length 	= ps->size;
+	token.kind 		= scan_number(ps->word, ps->size, &token.value);
+	ps->size 		= 0;
+
+	stream_token(ps, &token);
+}
+
+/* Keeps part of a word that may continue in the next chunk */
+static char stream_keep(ParusStream* ps, const char* s, size_t len) {
+	if (ps->size + len > ps->max) {
+		size_t 	max 	= (ps->size + len) * 2;
+		char* 	word 	= realloc(ps->word, max);
+		if (word == NULL) {
+			fprintf(parus_errors(), "CANNOT ALLOCATE STREAM\n");
+			ps->failed = 1;
+			return 0;
 		}
 
-		// if a complete expression is yet to be read continue
-		if (pd == NULL) continue;
+		ps->word 	= word;
+		ps->max 	= max;
+	}
 
-		// quotates the expression
-		while (qtstk->size > 0) {
-			ParusData* qtop;
-			if (qtstk->size > 0 && (qtop = stack_pull(qtstk)) != NULL) {
-				qtop->data.quoted = pd;
-				pd = qtop;
-			}
-			else {
-				stack_push(qtstk, NULL); // return bookmark
-				break;
-			}
+	memcpy(ps->word + ps->size, s, len);
+	ps->size += len;
+	return 1;
+}
+
+/*
+Evaluates the next chunk of the source, top level forms are evaluated as soon as they are complete.
+a word at the end of the chunk is kept until the next chunk shows where it ends
+*/
+void parus_stream_feed(ParusStream* ps, const char* chunk, size_t len) {
+	struct token 	token;
+	size_t 			pos = 0;
+
+	if (ps->failed)
+		return;
+
+	// finish the word cut by the previous chunk
+	if (ps->size > 0) {
+		while (pos < len && !is_delimiter(chunk[pos]))
+			pos++;
+
+		if (!stream_keep(ps, chunk, pos) || pos == len)
+			return;
+
+		stream_word(ps);
+	}
+
+	for (next_token(chunk, len, &pos, &token, &ps->comment); 
+			token.kind != TOKEN_END && !ps->failed; 
+			next_token(chunk, len, &pos, &token, &ps->comment)) {
+
+		if (pos == len && token.kind != TOKEN_OPEN && token.kind != TOKEN_CLOSE && token.kind != TOKEN_QUOTE) {
+			stream_keep(ps, token.start, token.length);
+			return;
 		}
 
-		if (opstk->size == 0) {
-			if (pd->type != SYMBOL && pd->type != QUOTED) 
-				stack_push(stk, pd); // self evaluating, push to the stack
-			else
-				parus_apply(pd, stk, lex); // non self evaluating, apply
+		stream_token(ps, &token);
+	}
+}
+
+/* 
+Evaluates what is left of the stream and validates that every form was completed.
+returns 0 if the whole stream was valid
+*/
+int parus_stream_end(ParusStream* ps) {
+	if (ps->size > 0 && !ps->failed)
+		stream_word(ps);
+
+	int e = ps->failed;
+
+	// validate expression
+	if (!ps->failed) {
+		if (ps->qtstk->size > 0 && ps->qtstk->items[ps->qtstk->size -1].type != NONE) { // if nothing to quote
+			fprintf(parus_errors(), "INVALID EXPRESSION GIVEN - STANDALONE QUOTE\n");
+			e = 1;
 		}
-		else // inserts instruction to top most operator
-			parus_insert_instr(opstk->items[opstk->size -1], pd);
+		else if (ps->opstk->size > 0) { // if unterminated expression given
+			fprintf(parus_errors(), "INVALID EXPRESSION GIVEN - UNTERMINATED OPERATOR\n");
+			e = 1;
+		}
+	}
+
+	ps->failed = 1; // nothing can be fed after the end
+	return e;
+}
+
+/* Frees the stream and every form that was not completed */
+void free_parus_stream(ParusStream* ps) {
+	if (ps != NULL) {
+		free_stack(ps->opstk);
+		free_stack(ps->qtstk);
+		free(ps->word);
+		free(ps);
+	}
+}
+
+/* The Parus Evaluator, the source is scanned in place and does not need to be terminated */
+void parus_evaluate(ParusVM* vm, const char* src, size_t len) {
+	ParusStream* ps = make_parus_stream(vm);
+	if (ps == NULL)
+		return;
+
+	parus_stream_feed(ps, src, len);
+	parus_stream_end(ps);
+	free_parus_stream(ps);
+}
+
+/* 
+Parses the source into its top level forms without evaluating them.
+returns NULL if the source is not valid
+*/
+Stack* parus_parse(const char* src, size_t len) {
+	ParusStream* ps = make_parus_stream(NULL);
+	if (ps == NULL)
+		return NULL;
+
+	ps->forms = make_stack();
+	parus_stream_feed(ps, src, len);
+
+	Stack* forms = ps->forms;
+	if (parus_stream_end(ps) != 0) {
+		free_stack(forms);
+		forms = NULL;
+	}
+
+	free_parus_stream(ps);
+	return forms;
+}
+
+/* Evaluates forms given by parus_parse, as if their source was evaluated */
+void parus_evaluate_forms(ParusVM* vm, Stack* forms) {
+	for (size_t i = 0; i < forms->size; i++) {
+		ParusData pd = parusdata_copy(forms->items[i]);
+
+		if (pd.type != SYMBOL && pd.type != QUOTED) 
+			stack_push(vm->stack, pd);
+		else
+			parus_apply(vm, pd);
+
+		if (vm->halted)
+			break;
+	}
+}
+
+/* 
+Evaluates a file chunk by chunk, only the forms being read are kept in memory.
+the file is read through its descriptor, nothing must have been read through f before
+*/
+void parus_evaluate_file(ParusVM* vm, FILE* f) {
+	ParusStream* ps = make_parus_stream(vm);
+	if (ps == NULL)
+		return;
+
+	char* chunk = malloc(STREAM_CHUNK);
+	if (chunk == NULL) {
+		fprintf(parus_errors(), "CANNOT ALLOCATE STREAM\n");
+		free_parus_stream(ps);
+		return;
+	}
+
+	// short reads, so a program piped in is evaluated as soon as each part of it arrives
+	ssize_t len;
+	while (!ps->failed) {
+		len = read(fileno(f), chunk, STREAM_CHUNK);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+
+		parus_stream_feed(ps, chunk, len);
+		fflush(vm->out);
 	}
 
-	free(buffer);
-	free_stack(opstk);
-	free_stack(qtstk);
+	parus_stream_end(ps);
+	free_parus_stream(ps);
+	free(chunk);
 }
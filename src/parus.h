@@ -31,16 +31,28 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define COMMENT_CHAR 	';'
 
 #define STACK_GROWTH 		50
-#define LEXICON_GROWTH 		50
+#define LEXICON_INITIAL 	64 // must be a power of two
+#define TRAIL_GROWTH 		64
 #define USEROP_INSTR_GROWTH 10
+#define SYMBOLS_INITIAL 	256 // must be a power of two
+#define STREAM_CHUNK 		65536
+#define VERSION_BLOCK 		65536 // lexicon versions taken by a thread at once
 
-#define MAXIMUM_CALL_DEPTH 50000
+#define MAXIMUM_CALL_DEPTH 		50000 // applications nested through base operators
+#define MAXIMUM_FRAMES_MEMORY 	(256 * 1024 * 1024) // bytes of frames of user op calls
+#define FRAMES_INITIAL 			64
+#define SCOPES_MAX 				8 // user ops written inside each other whose locals are visible
+
+#define FUSIONS_MAX 		32
+#define FUSION_MAX_WORDS 	4
+#define FUSION_MAX_WORD 	32
 
 #define HELP_MESSAGE "\nParus - Postfixed Reprogrammable Stack language\n" \
 	"Visit https://github.com/orendaniel/cparus for instructions and details.\n" \
 	"The language manual can be found at: https://github.com/orendaniel/parus-manual.\n" \
 	"Author's email: orendaniel150@gmail.com\n\n" \
-	"flags: -help -norepl -notitle file\n\n" 
+	"flags: -help -norepl -notitle -image file -save-image file -frames megabytes file (- for the standard input)\n" \
+	"batch: -batch -j workers -prelude file jobs (paths are read from the standard input when no job is given)\n\n" 
 
 #define TITLE_MESSAGE "CParus version 1.1\n" \
 	"CParus is free software under the GPLv3 license.\n" \
@@ -52,22 +64,26 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 typedef long 	integer_t;
 typedef double 	decimal_t;
 
-typedef int (*baseop_t)(void*, void*);
+struct parusvm;
 
-typedef struct {
-	union {
-		integer_t	integer;
-		decimal_t 	decimal;
-		char* 		symbol;
-		void* 		quoted; // pointer to ParusData
-		baseop_t	baseop;
-
-		struct { 
-			void** 	instructions; //array of ParusData*
-			size_t 	max;
-			size_t 	size;
-		} userop;
+typedef int (*baseop_t)(struct parusvm*);
 
+struct quote;
+struct userop;
+struct instr;
+
+/*
+ParusData is a value type small enough to be passed and stored inline,
+only symbols, quotes and user operators refer to heap storage.
+*/
+typedef struct parusdata {
+	union {
+		integer_t			integer;
+		decimal_t 			decimal;
+		char* 				symbol; // interned, compare by address
+		struct quote* 		quoted;
+		baseop_t			baseop;
+		struct userop* 		userop;
 	} data;
 	enum {
 		INTEGER,
@@ -76,68 +92,237 @@ typedef struct {
 		QUOTED,
 		BASEOP,
 		USEROP,
-		NONE // marks the instance as freed
+		NONE // marks an empty value
 	} type;
 } ParusData;
 
+// quotes and userops are shared between references and freed with the last one
+
+struct quote {
+	ParusData 	value;
+	size_t 		refs;
+};
+
+struct userop {
+	ParusData* 		instructions;
+	size_t 			max;
+	size_t 			size;
+	size_t 			refs;
+
+	struct instr* 	code; // compiled instructions, NULL until compiled
+	size_t 			code_size;
+
+	size_t 			id; // unique, identifies the locals of the user op
+	int 			locals; // slots of its frame, known once compiled
+	size_t* 		scopes; // ids of the user ops whose locals the code reads, innermost first
+	int 			scopes_size;
+};
+
 
 typedef struct {
 	size_t 		max;
 	size_t 		size;
-	ParusData**	items;
+	ParusData*	items;
 
 } Stack;
 
 
+struct binding {
+	ParusData 			value;
+	struct binding* 	shadowed; // previous binding of the same name
+	size_t 				version; // the version of the lexicon once it was defined
+};
+
+/* A definition made while a mark is set, see lexicon_mark */
+struct trail {
+	char* 	name;
+	size_t 	version;
+};
+
 struct entry {
-	char*		name;
-	ParusData* 	value;
+	char*				name; // interned, NULL for an empty slot
+	struct binding* 	binding; // latest binding, NULL once every binding was deleted
 };
 
+/* Lexicons are open addressing hash tables indexed by the address of the interned name */
 typedef struct lexicon {
 	struct entry* 	entries;
 	size_t 			max;
 	size_t 			size;
+	size_t 			version; // changes whenever an entry is defined or deleted
+
+	struct trail* 	trail; // definitions made since the first mark
+	size_t 			trail_size;
+	size_t 			trail_max;
+	size_t* 		marks; // the trail size at every mark
+	size_t 			marks_size;
+	size_t 			marks_max;
 
 } Lexicon;
 
-typedef ParusData* (*applier_t)(void*, void*);
+/* 
+A stream evaluates source given in chunks,
+the forms that are not complete yet and a word cut by the end of a chunk are kept between chunks
+*/
+typedef struct parusstream {
+	struct parusvm* vm;
+	Stack* 		opstk; // operators yet to be terminated
+	Stack* 		qtstk; // quotes yet to be applied
+	Stack* 		forms; // when set, top level forms are kept here instead of being evaluated
+	char* 		word; // part of a word cut by the end of the last chunk
+	size_t 		size;
+	size_t 		max;
+	char 		comment; // the last chunk ended inside a comment
+	char 		failed; // the rest of the stream is ignored
+
+} ParusStream;
 
+typedef ParusData (*applier_t)(struct parusvm*);
 
-ParusData* 		parusdata_copy(ParusData* original);
-ParusData* 		make_parus_integer(integer_t i);
-integer_t 		parusdata_tointeger(ParusData* pd);
-ParusData* 		make_parus_decimal(decimal_t d);
-decimal_t 		parusdata_todecimal(ParusData* pd);
-ParusData* 		make_parus_symbol(char* s);
-char* 			parusdata_getsymbol(ParusData* pd);
-ParusData* 		make_parus_quote(ParusData* quoted);
-ParusData* 		parusdata_unquote(ParusData* pd);
-ParusData* 		make_parus_baseop(baseop_t op);
-ParusData* 		make_parus_userop();
-void 			free_parusdata(ParusData* pd);
-void 			print_parusdata(ParusData* pd);
+/* The return point of a user op which called another operator */
+struct frame {
+	ParusData 		op; // the calling user op, the frame holds a reference
+	struct instr* 	ip; // the instruction to resume at
+	size_t 			windows; // windows of locals below the ones of the caller
+};
+
+/* The slots of the locals of a running user op */
+struct window {
+	size_t 	id; // of the user op
+	size_t 	base; // first slot
+	int 	size;
+};
+
+/* Loops run by the interpreter itself, see parus_define_loop */
+enum loop_kind {
+	LOOP_TIMES, // n (body) times
+	LOOP_RANGE, // start end (body) range, the index is pushed before every run of the body
+	LOOP_WHILE, // (cond) (body) while
+	LOOP_UNTIL 	// (cond) (body) until
+};
+
+/* A running loop, its body and condition are applied from frames which resume it */
+struct loop {
+	enum loop_kind 	kind;
+	char 			testing; // the condition is running
+	ParusData 		body;
+	ParusData 		cond;
+	integer_t 		index;
+	integer_t 		end;
+};
+
+/*
+An interpreter, interpreters share nothing but interned symbols and fusions.
+memory comes from the pool of the thread running the interpreter,
+an interpreter may move between threads but must not run on two threads at once
+*/
+typedef struct parusvm {
+	Stack* 		stack;
+	Lexicon* 	lexicon;
+
+	baseop_t 	apply_caller; // the base operator which called parus_apply
+	applier_t 	apply_shortcut; // back door to implement base operators like apply top
+	int 		call_depth; // nested calls of parus_apply
+
+	struct frame* 	frames; // calls between user ops are kept here instead of the C stack
+	size_t 			frames_size;
+	size_t 			frames_max;
+	size_t 			frames_limit; // maximum bytes of frames, MAXIMUM_FRAMES_MEMORY by default
+
+	ParusData* 		slots; // locals of the running user ops
+	size_t 			slots_size;
+	size_t 			slots_max;
+	struct window* 	windows;
+	size_t 			windows_size;
+	size_t 			windows_max;
+
+	struct loop* 	loops; // loops being run, innermost last
+	size_t 			loops_size;
+	size_t 			loops_max;
+
+	FILE* 		out; // output of the language, stdout by default
+	char 		pooled; // quit halts the interpreter instead of ending the process, as in a worker pool
+	char 		halted; // set by quit when pooled, applications return at once until it is cleared
+	size_t 		fired[FUSIONS_MAX]; // times every fusion was applied
+
+} ParusVM;
+
+/* 
+Fused operations get the integer literal of their pattern, if any.
+they return -1 without touching the stack when they cannot handle it
+*/
+typedef int (*fusedop_t)(ParusVM*, ParusData);
+
+
+FILE* 			parus_errors();
+void 			parus_set_errors(FILE* f);
+
+char* 			parus_intern(char* s);
+char* 			parus_intern_n(const char* s, size_t len);
+
+ParusData 		parusdata_copy(ParusData original);
+ParusData 		parusdata_unshare(ParusData pd);
+ParusData 		parusdata_clone(ParusData pd);
+ParusData 		make_parus_none();
+ParusData 		make_parus_integer(integer_t i);
+integer_t 		parusdata_tointeger(ParusData pd);
+ParusData 		make_parus_decimal(decimal_t d);
+decimal_t 		parusdata_todecimal(ParusData pd);
+ParusData 		make_parus_symbol(char* s);
+char* 			parusdata_getsymbol(ParusData pd);
+ParusData 		make_parus_quote(ParusData quoted);
+ParusData 		parusdata_unquote(ParusData pd);
+ParusData 		make_parus_baseop(baseop_t op);
+ParusData 		make_parus_userop();
+void 			free_parusdata(ParusData pd);
+void 			print_parusdata(FILE* f, ParusData pd);
 
 Stack* 		make_stack();
-void 		stack_push(Stack* stk, ParusData* pd);
-ParusData* 	stack_pull(Stack* stk);
-ParusData* 	stack_get_at(Stack* stk, size_t index);
+void 		stack_push(Stack* stk, ParusData pd);
+ParusData 	stack_pull(Stack* stk);
+ParusData 	stack_get_at(Stack* stk, size_t index);
 void 		stack_remove_at(Stack* stk, size_t index);
+size_t 		stack_take_slice(Stack* stk, size_t index, size_t count, ParusData* items);
+void 		stack_remove_slice(Stack* stk, size_t index, size_t count);
 void 		free_stack(Stack* stk);
-void 		print_stack(Stack* stk);
+void 		print_stack(FILE* f, Stack* stk);
 
 Lexicon* 	make_lexicon();
-void 		lexicon_define(Lexicon* lex, char* name, ParusData* pd);
+void 		lexicon_define(Lexicon* lex, char* name, ParusData pd);
 void 		lexicon_delete(Lexicon* lex, char* name);
-ParusData* 	lexicon_get(Lexicon* lex, char* name);
+struct binding* lexicon_lookup(Lexicon* lex, char* name);
+ParusData 	lexicon_get(Lexicon* lex, char* name);
 void 		free_lexicon(Lexicon* lex);
-void 		print_lexicon(Lexicon* lex);
+Lexicon* 	lexicon_copy(Lexicon* lex);
+Lexicon* 	lexicon_clone(Lexicon* lex);
+void 		print_lexicon(FILE* f, Lexicon* lex);
+size_t 		lexicon_mark(Lexicon* lex);
+int 		lexicon_rollback(Lexicon* lex, size_t mark);
+
+
+void 	parus_define_fusion(char* pattern, fusedop_t op, char applies);
+void 	parus_define_apply(baseop_t op);
+void 	parus_define_let(char* name, baseop_t op);
+void 	parus_define_case(char* begin, char* end, baseop_t op);
+void 	parus_define_loop(enum loop_kind kind, baseop_t op);
+void 	print_fusions(FILE* f, ParusVM* vm);
 
+ParusVM* 	make_parus_vm(Lexicon* lex);
+void 		free_parus_vm(ParusVM* vm);
 
-void 	parus_insert_instr(ParusData* op, ParusData* instr);
+void 	parus_insert_instr(ParusData* op, ParusData instr);
+void 	parus_insert_slice(ParusData* op, Stack* stk, size_t index, size_t count);
 int 	parus_parencount(char* str);
-void 	parus_set_applier(baseop_t caller, applier_t applier);
-int 	parus_apply(ParusData* pd, Stack* stk, Lexicon* lex);
-void 	parus_evaluate(char* input, Stack* stk, Lexicon* lex);
+void 	parus_set_applier(ParusVM* vm, baseop_t caller, applier_t applier);
+int 	parus_apply(ParusVM* vm, ParusData pd);
+void 	parus_evaluate(ParusVM* vm, const char* input, size_t len);
+void 	parus_evaluate_file(ParusVM* vm, FILE* f);
+Stack* 	parus_parse(const char* src, size_t len);
+void 	parus_evaluate_forms(ParusVM* vm, Stack* forms);
+
+ParusStream* 	make_parus_stream(ParusVM* vm);
+void 			parus_stream_feed(ParusStream* ps, const char* chunk, size_t len);
+int 			parus_stream_end(ParusStream* ps);
+void 			free_parus_stream(ParusStream* ps);
 
 #endif
@@ -0,0 +1,168 @@
+/*
+CParus
+Copyright (C) 2020  Oren Daniel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "parus_alloc.h"
+#include <string.h>
+#include <pthread.h>
+
+#ifdef USE_MALLOC
+
+void* parus_alloc(size_t size) {
+	return malloc(size);
+}
+
+void* parus_realloc(void* ptr, size_t old_size, size_t new_size) {
+	return realloc(ptr, new_size);
+}
+
+void parus_free(void* ptr, size_t size) {
+	free(ptr);
+}
+
+void parus_alloc_release() {
+}
+
+#else
+
+struct block {
+	struct block* next;
+};
+
+// every thread recycles blocks through its own lists, so no locking is needed
+static _Thread_local struct block* free_lists[POOL_CLASSES];
+
+// free lists given back by threads, the first block of a list links to the next list
+struct chain {
+	struct block* 	blocks;
+	struct chain* 	next;
+};
+
+static pthread_mutex_t 	depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct chain* 	depot[POOL_CLASSES];
+
+/* Returns the size class of a block, or -1 if the size is too large for the pool */
+static int size_class(size_t size) {
+	size_t 	block 	= POOL_MIN_BLOCK;
+	int 	cls 	= 0;
+
+	while (block < size) {
+		block <<= 1;
+		cls++;
+	}
+
+	return cls < POOL_CLASSES ? cls : -1;
+}
+
+/* Takes a free list given back by another thread, or carves a new slab into blocks of a size class */
+static struct block* refill(int cls) {
+	pthread_mutex_lock(&depot_lock);
+	struct chain* ch = depot[cls];
+	if (ch != NULL)
+		depot[cls] = ch->next;
+	pthread_mutex_unlock(&depot_lock);
+
+	if (ch != NULL) {
+		struct block* b = (struct block*)ch; // the link is a free block as well
+		b->next 		= ch->blocks;
+		return b;
+	}
+
+	size_t 	block_size 	= POOL_MIN_BLOCK << cls;
+	char* 	slab 		= malloc(POOL_SLAB_SIZE);
+
+	if (slab == NULL)
+		return NULL;
+
+	size_t count = POOL_SLAB_SIZE / block_size;
+	for (size_t i = 0; i < count -1; i++)
+		((struct block*)(slab + i * block_size))->next = (struct block*)(slab + (i +1) * block_size);
+
+	((struct block*)(slab + (count -1) * block_size))->next = NULL;
+
+	return (struct block*)slab;
+}
+
+/* Allocates a block of at least size bytes */
+void* parus_alloc(size_t size) {
+	int cls = size_class(size);
+	if (cls < 0)
+		return malloc(size);
+
+	struct block* b = free_lists[cls];
+	if (b == NULL && (b = refill(cls)) == NULL)
+		return NULL;
+
+	free_lists[cls] = b->next;
+	return b;
+}
+
+/* Resizes a block, the content is kept up to the smaller size */
+void* parus_realloc(void* ptr, size_t old_size, size_t new_size) {
+	int old_cls = size_class(old_size);
+	int new_cls = size_class(new_size);
+
+	if (old_cls < 0 && new_cls < 0)
+		return realloc(ptr, new_size);
+
+	if (ptr != NULL && old_cls == new_cls)
+		return ptr;
+
+	void* nptr = parus_alloc(new_size);
+	if (nptr != NULL && ptr != NULL) {
+		memcpy(nptr, ptr, old_size < new_size ? old_size : new_size);
+		parus_free(ptr, old_size);
+	}
+
+	return nptr;
+}
+
+/* Returns a block to the free list of the calling thread */
+void parus_free(void* ptr, size_t size) {
+	if (ptr == NULL)
+		return;
+
+	int cls = size_class(size);
+	if (cls < 0) {
+		free(ptr);
+		return;
+	}
+
+	struct block* b = ptr;
+	b->next 		= free_lists[cls];
+	free_lists[cls] = b;
+}
+
+/* Gives the free lists of the calling thread to the depot */
+void parus_alloc_release() {
+	for (int cls = 0; cls < POOL_CLASSES; cls++) {
+		struct block* b = free_lists[cls];
+		if (b == NULL)
+			continue;
+
+		struct chain* ch 	= (struct chain*)b;
+		ch->blocks 			= b->next;
+		free_lists[cls] 	= NULL;
+
+		pthread_mutex_lock(&depot_lock);
+		ch->next 	= depot[cls];
+		depot[cls] 	= ch;
+		pthread_mutex_unlock(&depot_lock);
+	}
+}
+
+#endif
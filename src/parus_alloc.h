@@ -0,0 +1,42 @@
+/*
+CParus
+Copyright (C) 2020  Oren Daniel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARUS_ALLOC_H
+#define PARUS_ALLOC_H
+
+#include <stdlib.h>
+
+/*
+Size class pool allocator used by the interpreter.
+Blocks are carved from slabs and recycled through thread local free lists,
+compile with USE_MALLOC to fall back to the plain libc allocator.
+The size of a block must be given back when it is freed or resized.
+A thread that stops using the interpreter calls parus_alloc_release
+so other threads can reuse its free blocks.
+*/
+
+#define POOL_MIN_BLOCK 	16
+#define POOL_CLASSES 	8 // 16, 32 ... 2048 bytes
+#define POOL_SLAB_SIZE 	65536
+
+void* 	parus_alloc(size_t size);
+void* 	parus_realloc(void* ptr, size_t old_size, size_t new_size);
+void 	parus_free(void* ptr, size_t size);
+void 	parus_alloc_release();
+
+#endif
@@ -0,0 +1,192 @@
+/*
+CParus
+Copyright (C) 2020  Oren Daniel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "parus_batch.h"
+#include "parus_predefined.h"
+#include "parus_image.h"
+#include "parus_alloc.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+struct batch_state {
+	ParusBatch* 		batch;
+	ParusJob* 			jobs;
+	size_t 				count;
+	atomic_size_t 		next; // the next job to take
+
+	pthread_mutex_t 	lock;
+	pthread_cond_t 		finished; // signaled whenever a job is done
+};
+
+/* Evaluates a script file, returns 0 if it could be opened */
+static int evaluate_path(ParusVM* vm, char* path) {
+	FILE* f = fopen(path, "r");
+	if (f == NULL) {
+		fprintf(parus_errors(), "CANNOT OPEN FILE %s\n", path);
+		return 1;
+	}
+
+	parus_evaluate_file(vm, f);
+	fclose(f);
+	return 0;
+}
+
+/* Copies the values of a stack */
+static Stack* copy_stack(Stack* stk) {
+	Stack* copy = make_stack();
+	for (size_t i = 0; i < stk->size; i++)
+		stack_push(copy, parusdata_copy(stk->items[i]));
+	return copy;
+}
+
+/* Runs a job on a copy of the lexicon and stack of the worker */
+static void run_job(ParusVM* vm, ParusJob* job) {
+	Lexicon* 	lex = vm->lexicon;
+	Stack* 		stk = vm->stack;
+
+	vm->lexicon 	= lexicon_copy(lex);
+	vm->stack 		= copy_stack(stk);
+	vm->call_depth 	= 0;
+	vm->halted 		= 0;
+	parus_set_applier(vm, NULL, NULL);
+
+	job->output 		= NULL;
+	job->output_size 	= 0;
+	FILE* out 			= open_memstream(&job->output, &job->output_size);
+	vm->out 			= out != NULL ? out : stdout;
+
+	// diagnostics are kept with the job, so the ones of jobs running at once do not mix
+	job->errors 		= NULL;
+	job->errors_size 	= 0;
+	FILE* errors 		= open_memstream(&job->errors, &job->errors_size);
+	parus_set_errors(errors);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (job->source != NULL)
+		parus_evaluate(vm, job->source, job->length);
+	else if (job->path != NULL)
+		evaluate_path(vm, job->path);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	job->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if (out != NULL)
+		fclose(out);
+
+	parus_set_errors(NULL);
+	if (errors != NULL)
+		fclose(errors);
+
+	free_lexicon(vm->lexicon);
+	free_stack(vm->stack);
+	vm->lexicon = lex;
+	vm->stack 	= stk;
+	vm->out 	= stdout;
+	vm->halted 	= 0;
+}
+
+static void* batch_worker(void* arg) {
+	struct batch_state* st = arg;
+
+	ParusVM* vm = make_parus_vm(predefined_lexicon());
+	if (vm != NULL) {
+		vm->pooled = 1; // quit ends the job, not the process
+
+		if (st->batch->image != NULL)
+			parus_load_image(vm, st->batch->image);
+		if (st->batch->prelude != NULL)
+			evaluate_path(vm, st->batch->prelude);
+	}
+
+	size_t i;
+	while ((i = atomic_fetch_add(&st->next, 1)) < st->count) {
+		if (vm != NULL)
+			run_job(vm, &st->jobs[i]);
+
+		pthread_mutex_lock(&st->lock);
+		st->jobs[i].done = 1;
+		pthread_cond_broadcast(&st->finished);
+		pthread_mutex_unlock(&st->lock);
+	}
+
+	free_parus_vm(vm);
+	parus_include_release();
+	parus_alloc_release();
+	return NULL;
+}
+
+/*
+Evaluates jobs on a pool of worker threads, workers take the next job as soon as they are free.
+returns 0 if every worker could be started
+*/
+int parus_batch(ParusBatch* batch, ParusJob* jobs, size_t count) {
+	struct batch_state st;
+	pthread_t 	threads[BATCH_MAX_WORKERS];
+	int 		workers = batch->workers;
+
+	if (workers < 1)
+		workers = 1;
+	if (workers > BATCH_MAX_WORKERS)
+		workers = BATCH_MAX_WORKERS;
+	if (workers > count && count > 0)
+		workers = count;
+
+	st.batch 	= batch;
+	st.jobs 	= jobs;
+	st.count 	= count;
+	atomic_init(&st.next, 0);
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.finished, NULL);
+
+	for (size_t i = 0; i < count; i++)
+		jobs[i].done = 0;
+
+	int started = 0;
+	for (; started < workers; started++)
+		if (pthread_create(&threads[started], NULL, &batch_worker, &st) != 0)
+			break;
+
+	if (started == 0) {
+		fprintf(parus_errors(), "CANNOT START WORKERS\n");
+		pthread_mutex_destroy(&st.lock);
+		pthread_cond_destroy(&st.finished);
+		return 1;
+	}
+
+	// report the jobs in order
+	for (size_t i = 0; i < count; i++) {
+		pthread_mutex_lock(&st.lock);
+		while (!jobs[i].done)
+			pthread_cond_wait(&st.finished, &st.lock);
+		pthread_mutex_unlock(&st.lock);
+
+		if (batch->done != NULL)
+			(*batch->done)(&jobs[i], i, batch->arg);
+	}
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&st.lock);
+	pthread_cond_destroy(&st.finished);
+	return started < workers;
+}
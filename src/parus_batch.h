@@ -0,0 +1,60 @@
+/*
+CParus
+Copyright (C) 2020  Oren Daniel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARUS_BATCH_H
+#define PARUS_BATCH_H
+
+#include "parus.h"
+
+#define BATCH_MAX_WORKERS 256
+
+/* A job is given as source, or as the path of a script when source is NULL */
+typedef struct {
+	const char* 	source;
+	size_t 			length;
+	char* 			path;
+
+	char* 			output; // the output of the job once it is done, freed with free
+	size_t 			output_size;
+	char* 			errors; // the diagnostics of the job, freed with free
+	size_t 			errors_size;
+	double 			seconds; // time spent evaluating the job
+	char 			done;
+
+} ParusJob;
+
+/*
+Every worker owns an interpreter made of the predefined lexicon,
+the image and the prelude are applied once per worker.
+a job starts from a copy of that lexicon and stack, so jobs do not see each other's definitions.
+quit ends the job it is applied in, the worker goes on with the next job
+*/
+typedef struct {
+	int 	workers;
+	char* 	image; // may be NULL
+	char* 	prelude; // path of a script, may be NULL
+
+	// called from the calling thread for every job in order, as soon as it and the jobs before it are done
+	void 	(*done)(ParusJob* job, size_t index, void* arg);
+	void* 	arg;
+
+} ParusBatch;
+
+int parus_batch(ParusBatch* batch, ParusJob* jobs, size_t count);
+
+#endif
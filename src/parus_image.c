@@ -0,0 +1,686 @@
+/*
+CParus
+Copyright (C) 2020  Oren Daniel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "parus_image.h"
+#include "parus_predefined.h"
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+Layout of an image, numbers are in the byte order of the machine that saved it
+
+magic, version, byte order
+symbols 	: count, then length and characters of every name
+user ops 	: count, then the instruction count and values of every user op
+lexicon 	: count, then the name and bindings of every entry, oldest binding first
+stack 		: count, then the values from the bottom
+
+a value is its type followed by
+integer and decimal 	: 8 bytes
+symbol and base op 		: index of the name
+quote 					: the quoted value
+user op 				: index of a user op saved before it
+*/
+
+// POINTER MAP
+// ----------------------------------------------------------------------------------------------------
+
+// indexes symbols and user ops by address, in order of insertion
+struct ptrmap {
+	void** 		keys;
+	size_t* 	slots; // index of the key +1, 0 for an empty slot
+	size_t 		size;
+	size_t 		max; // of slots
+};
+
+static size_t hash_pointer(void* p, size_t max) {
+	return (((uintptr_t)p >> 4) * 11400714819323198485UL) & (max -1);
+}
+
+/* Returns the index of a key, or -1 */
+static long ptrmap_find(struct ptrmap* map, void* key) {
+	if (map->max == 0)
+		return -1;
+
+	for (size_t i = hash_pointer(key, map->max); map->slots[i] != 0; i = (i +1) & (map->max -1))
+		if (map->keys[map->slots[i] -1] == key)
+			return map->slots[i] -1;
+
+	return -1;
+}
+
+/* Adds a key that is not in the map yet */
+static char ptrmap_add(struct ptrmap* map, void* key) {
+	if (map->size * 2 >= map->max) {
+		size_t 	max 	= map->max == 0 ? 64 : map->max * 2;
+		size_t* slots 	= calloc(max, sizeof(size_t));
+		void** 	keys 	= realloc(map->keys, max / 2 * sizeof(void*));
+
+		if (slots == NULL || keys == NULL) {
+			free(slots);
+			if (keys != NULL)
+				map->keys = keys;
+			return 0;
+		}
+
+		for (size_t i = 0; i < map->size; i++) {
+			size_t j = hash_pointer(keys[i], max);
+			while (slots[j] != 0)
+				j = (j +1) & (max -1);
+			slots[j] = i +1;
+		}
+
+		free(map->slots);
+		map->slots 	= slots;
+		map->keys 	= keys;
+		map->max 	= max;
+	}
+
+	size_t i = hash_pointer(key, map->max);
+	while (map->slots[i] != 0)
+		i = (i +1) & (map->max -1);
+
+	map->keys[map->size++] 	= key;
+	map->slots[i] 			= map->size;
+	return 1;
+}
+
+static void free_ptrmap(struct ptrmap* map) {
+	free(map->keys);
+	free(map->slots);
+}
+
+// SAVING
+// ----------------------------------------------------------------------------------------------------
+
+struct image_writer {
+	FILE* 			f;
+	struct ptrmap 	symbols;
+	struct ptrmap 	userops; // nested user ops come before the user ops using them
+};
+
+static char collect_symbol(struct image_writer* w, char* name) {
+	return ptrmap_find(&w->symbols, name) >= 0 || ptrmap_add(&w->symbols, name);
+}
+
+/* Indexes every symbol and user op a value refers to */
+static char collect_value(struct image_writer* w, ParusData pd) {
+	if (pd.type == SYMBOL)
+		return collect_symbol(w, parusdata_getsymbol(pd));
+
+	else if (pd.type == BASEOP) {
+		char* name = predefined_name(pd.data.baseop);
+		if (name == NULL) {
+			fprintf(parus_errors(), "CANNOT SAVE A BASE OPERATOR THAT IS NOT PREDEFINED\n");
+			return 0;
+		}
+		return collect_symbol(w, parus_intern(name));
+	}
+
+	else if (pd.type == QUOTED)
+		return collect_value(w, parusdata_unquote(pd));
+
+	else if (pd.type == USEROP && ptrmap_find(&w->userops, pd.data.userop) < 0) {
+		for (size_t i = 0; i < pd.data.userop->size; i++)
+			if (!collect_value(w, pd.data.userop->instructions[i]))
+				return 0;
+		return ptrmap_add(&w->userops, pd.data.userop);
+	}
+
+	return 1;
+}
+
+static void write_u32(struct image_writer* w, uint32_t n) {
+	fwrite(&n, sizeof(n), 1, w->f);
+}
+
+static void write_value(struct image_writer* w, ParusData pd) {
+	fputc(pd.type, w->f);
+
+	if (pd.type == INTEGER) {
+		int64_t i = parusdata_tointeger(pd);
+		fwrite(&i, sizeof(i), 1, w->f);
+	}
+	else if (pd.type == DECIMAL) {
+		double d = parusdata_todecimal(pd);
+		fwrite(&d, sizeof(d), 1, w->f);
+	}
+	else if (pd.type == SYMBOL)
+		write_u32(w, ptrmap_find(&w->symbols, parusdata_getsymbol(pd)));
+
+	else if (pd.type == BASEOP)
+		write_u32(w, ptrmap_find(&w->symbols, parus_intern(predefined_name(pd.data.baseop))));
+
+	else if (pd.type == QUOTED)
+		write_value(w, parusdata_unquote(pd));
+
+	else if (pd.type == USEROP)
+		write_u32(w, ptrmap_find(&w->userops, pd.data.userop));
+}
+
+/* Returns the number of bindings of an entry */
+static uint32_t count_bindings(struct entry* e) {
+	uint32_t count = 0;
+	for (struct binding* bnd = e->binding; bnd != NULL; bnd = bnd->shadowed)
+		count++;
+	return count;
+}
+
+/* Writes the bindings of an entry, the oldest first so loading redefines them in order */
+static void write_bindings(struct image_writer* w, struct binding* bnd) {
+	if (bnd == NULL)
+		return;
+	write_bindings(w, bnd->shadowed);
+	write_value(w, bnd->value);
+}
+
+/* Writes an image of the lexicon, which may be NULL, and the stack. returns 0 on success */
+static int write_image(FILE* f, Stack* stk, Lexicon* lex) {
+	struct image_writer w 	= {0};
+	uint32_t 			entries = 0;
+	char 				ok 		= 1;
+	size_t 				max 	= lex != NULL ? lex->max : 0;
+
+	for (size_t i = 0; i < max && ok; i++) {
+		if (lex->entries[i].name == NULL || lex->entries[i].binding == NULL)
+			continue;
+
+		entries++;
+		ok = collect_symbol(&w, lex->entries[i].name);
+		for (struct binding* bnd = lex->entries[i].binding; bnd != NULL && ok; bnd = bnd->shadowed)
+			ok = collect_value(&w, bnd->value);
+	}
+	for (size_t i = 0; i < stk->size && ok; i++)
+		ok = collect_value(&w, stk->items[i]);
+
+	if (!ok) {
+		free_ptrmap(&w.symbols);
+		free_ptrmap(&w.userops);
+		return 1;
+	}
+
+	w.f = f;
+	fwrite(IMAGE_MAGIC, 1, strlen(IMAGE_MAGIC), w.f);
+	write_u32(&w, IMAGE_VERSION);
+	write_u32(&w, IMAGE_BYTE_ORDER);
+
+	write_u32(&w, w.symbols.size);
+	for (size_t i = 0; i < w.symbols.size; i++) {
+		write_u32(&w, strlen(w.symbols.keys[i]));
+		fwrite(w.symbols.keys[i], 1, strlen(w.symbols.keys[i]), w.f);
+	}
+
+	write_u32(&w, w.userops.size);
+	for (size_t i = 0; i < w.userops.size; i++) {
+		struct userop* uop = w.userops.keys[i];
+		write_u32(&w, uop->size);
+		for (size_t j = 0; j < uop->size; j++)
+			write_value(&w, uop->instructions[j]);
+	}
+
+	write_u32(&w, entries);
+	for (size_t i = 0; i < max; i++) {
+		if (lex->entries[i].name == NULL || lex->entries[i].binding == NULL)
+			continue;
+
+		write_u32(&w, ptrmap_find(&w.symbols, lex->entries[i].name));
+		write_u32(&w, count_bindings(&lex->entries[i]));
+		write_bindings(&w, lex->entries[i].binding);
+	}
+
+	write_u32(&w, stk->size);
+	for (size_t i = 0; i < stk->size; i++)
+		write_value(&w, stk->items[i]);
+
+	free_ptrmap(&w.symbols);
+	free_ptrmap(&w.userops);
+	return ferror(f) != 0;
+}
+
+/* Saves the lexicon and the stack of an interpreter to an image, returns 0 on success */
+int parus_save_image(ParusVM* vm, char* path) {
+	FILE* f = fopen(path, "wb");
+	if (f == NULL) {
+		fprintf(parus_errors(), "CANNOT SAVE IMAGE %s\n", path);
+		return 1;
+	}
+
+	int e = write_image(f, vm->stack, vm->lexicon);
+	if (fclose(f) != 0 || e) {
+		fprintf(parus_errors(), "CANNOT SAVE IMAGE %s\n", path);
+		e = 1;
+	}
+
+	return e;
+}
+
+// LOADING
+// ----------------------------------------------------------------------------------------------------
+
+struct image_reader {
+	const unsigned char* 	p;
+	const unsigned char* 	end;
+	char** 					symbols;
+	uint32_t 				nsymbols;
+	ParusData* 				userops;
+	uint32_t 				nuserops; // loaded so far
+	char 					failed; // the image is truncated or refers to missing items
+};
+
+static char read_bytes(struct image_reader* r, void* dest, size_t size) {
+	if (r->failed || (size_t)(r->end - r->p) < size) {
+		r->failed = 1;
+		return 0;
+	}
+
+	memcpy(dest, r->p, size);
+	r->p += size;
+	return 1;
+}
+
+static uint32_t read_u32(struct image_reader* r) {
+	uint32_t n = 0;
+	read_bytes(r, &n, sizeof(n));
+	return n;
+}
+
+/* Returns the symbol of an index read from the image */
+static char* read_symbol(struct image_reader* r) {
+	uint32_t i = read_u32(r);
+	if (r->failed || i >= r->nsymbols) {
+		r->failed = 1;
+		return NULL;
+	}
+	return r->symbols[i];
+}
+
+static ParusData read_value(struct image_reader* r) {
+	unsigned char type = 0;
+	if (!read_bytes(r, &type, 1))
+		return make_parus_none();
+
+	if (type == INTEGER) {
+		int64_t i = 0;
+		read_bytes(r, &i, sizeof(i));
+		return make_parus_integer(i);
+	}
+	else if (type == DECIMAL) {
+		double d = 0;
+		read_bytes(r, &d, sizeof(d));
+		return make_parus_decimal(d);
+	}
+	else if (type == SYMBOL) {
+		char* name = read_symbol(r);
+		return name != NULL ? make_parus_symbol(name) : make_parus_none();
+	}
+	else if (type == BASEOP) {
+		char* 		name 	= read_symbol(r);
+		baseop_t 	op 		= name != NULL ? predefined_op(name) : NULL;
+		if (op == NULL) {
+			if (name != NULL)
+				fprintf(parus_errors(), "UNKNOWN BASE OPERATOR IN IMAGE - %s\n", name);
+			r->failed = 1;
+			return make_parus_none();
+		}
+		return make_parus_baseop(op);
+	}
+	else if (type == QUOTED) {
+		ParusData quoted = read_value(r);
+		return quoted.type != NONE ? make_parus_quote(quoted) : quoted;
+	}
+	else if (type == USEROP) {
+		uint32_t i = read_u32(r);
+		if (r->failed || i >= r->nuserops) {
+			r->failed = 1;
+			return make_parus_none();
+		}
+		return parusdata_copy(r->userops[i]);
+	}
+	else if (type != NONE)
+		r->failed = 1;
+
+	return make_parus_none();
+}
+
+/* Decodes an image, the stack is only changed when the whole image is valid */
+static char read_image(struct image_reader* r, Stack* stk, Lexicon* lex) {
+	char magic[sizeof(IMAGE_MAGIC) -1];
+
+	if (!read_bytes(r, magic, sizeof(magic)) || memcmp(magic, IMAGE_MAGIC, sizeof(magic)) != 0
+			|| read_u32(r) != IMAGE_VERSION || read_u32(r) != IMAGE_BYTE_ORDER)
+		return 0;
+
+	r->nsymbols = read_u32(r);
+	if (r->failed || r->nsymbols > (size_t)(r->end - r->p) ||
+			(r->symbols = malloc((r->nsymbols +1) * sizeof(char*))) == NULL)
+		return 0;
+
+	for (uint32_t i = 0; i < r->nsymbols; i++) {
+		uint32_t len = read_u32(r);
+		if (r->failed || len > (size_t)(r->end - r->p))
+			return 0;
+
+		r->symbols[i] 	= parus_intern_n((const char*)r->p, len);
+		r->p 			+= len;
+		if (r->symbols[i] == NULL)
+			return 0;
+	}
+
+	uint32_t nuserops = read_u32(r);
+	if (r->failed || nuserops > (size_t)(r->end - r->p) ||
+			(r->userops = malloc((nuserops +1) * sizeof(ParusData))) == NULL)
+		return 0;
+
+	for (; r->nuserops < nuserops; r->nuserops++) {
+		uint32_t 	size 	= read_u32(r);
+		ParusData 	op 		= make_parus_userop();
+
+		for (uint32_t i = 0; i < size && !r->failed; i++)
+			parus_insert_instr(&op, read_value(r));
+
+		r->userops[r->nuserops] = op;
+		if (r->failed) {
+			r->nuserops++;
+			return 0;
+		}
+	}
+
+	uint32_t entries = read_u32(r);
+	if (lex == NULL && entries > 0)
+		r->failed = 1;
+
+	for (uint32_t i = 0; i < entries && !r->failed; i++) {
+		char* 		name 		= read_symbol(r);
+		uint32_t 	bindings 	= read_u32(r);
+
+		for (uint32_t j = 0; j < bindings && !r->failed; j++) {
+			ParusData pd = read_value(r);
+			if (!r->failed)
+				lexicon_define(lex, name, pd);
+		}
+	}
+
+	Stack* 		items 	= make_stack();
+	uint32_t 	size 	= read_u32(r);
+	for (uint32_t i = 0; i < size && !r->failed; i++)
+		stack_push(items, read_value(r));
+
+	if (!r->failed && r->p == r->end) {
+		for (size_t i = 0; i < items->size; i++)
+			stack_push(stk, items->items[i]);
+		items->size = 0; // moved to the stack
+	}
+	else
+		r->failed = 1;
+
+	free_stack(items);
+	return !r->failed;
+}
+
+/* Decodes an image from memory, returns if it was valid */
+static char decode_image(const void* image, size_t size, Stack* stk, Lexicon* lex) {
+	struct image_reader r = {0};
+	r.p 	= image;
+	r.end 	= r.p + size;
+
+	char ok = read_image(&r, stk, lex);
+
+	for (uint32_t i = 0; i < r.nuserops; i++)
+		free_parusdata(r.userops[i]);
+	free(r.userops);
+	free(r.symbols);
+
+	return ok;
+}
+
+/* 
+Maps a whole regular file read only, the pages are shared with every process reading the same file.
+returns NULL if it cannot be opened, is not a regular file or is empty, the mapping is released with munmap
+*/
+void* parus_map_file(char* path, size_t* size) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0)
+		return NULL;
+
+	void* map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // the mapping stays valid
+
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+	return map;
+}
+
+/* 
+Loads an image into an interpreter, the image is mapped and decoded in place.
+the lexicon of the image replaces the lexicon of the interpreter and its stack is pushed.
+returns 0 on success
+*/
+int parus_load_image(ParusVM* vm, char* path) {
+	size_t 	size;
+	void* 	image = parus_map_file(path, &size);
+
+	if (image == NULL) {
+		fprintf(parus_errors(), "CANNOT OPEN IMAGE %s\n", path);
+		return 1;
+	}
+
+	Lexicon* 	lex = make_lexicon();
+	int 		e 	= !decode_image(image, size, vm->stack, lex);
+
+	if (e) {
+		fprintf(parus_errors(), "INVALID IMAGE %s\n", path);
+		free_lexicon(lex);
+	}
+	else {
+		free_lexicon(vm->lexicon);
+		vm->lexicon = lex;
+	}
+
+	munmap(image, size);
+	return e;
+}
+
+// MODULES
+// ----------------------------------------------------------------------------------------------------
+
+/*
+Included files are kept as their parsed top level forms, in memory and in a cache file next to the source.
+a cached module is used while the modification time and size of its source are unchanged.
+parsed forms are not shared between threads, so every thread keeps its own modules
+*/
+static _Thread_local struct module {
+	char* 			path; // interned
+	int64_t 		mtime;
+	int64_t 		size;
+	Stack* 			forms;
+	char 			including; // the module is being evaluated
+	struct module* 	next;
+}* modules;
+
+// the key of a module cache, followed by an image with the forms as its stack
+struct module_key {
+	char 		magic[8];
+	int64_t 	mtime;
+	int64_t 	size;
+};
+
+/* Frees the modules kept by the calling thread, a thread which included files calls it before it exits */
+void parus_include_release() {
+	while (modules != NULL) {
+		struct module* next = modules->next;
+		free_stack(modules->forms);
+		free(modules);
+		modules = next;
+	}
+}
+
+/* Returns the path of the cache file of a module */
+static char* cache_path(char* path) {
+	char* cache = malloc(strlen(path) + strlen(MODULE_CACHE_SUFFIX) +1);
+	if (cache != NULL) {
+		strcpy(cache, path);
+		strcat(cache, MODULE_CACHE_SUFFIX);
+	}
+	return cache;
+}
+
+/* Returns the forms in the cache file of a module, or NULL if the cache is missing or stale */
+static Stack* load_cached_forms(struct module* mod) {
+	char* 	cache = cache_path(mod->path);
+	size_t 	size;
+	void* 	map;
+
+	if (cache == NULL || (map = parus_map_file(cache, &size)) == NULL) {
+		free(cache);
+		return NULL;
+	}
+
+	Stack* 				forms 	= NULL;
+	struct module_key 	key;
+
+	if (size >= sizeof(key)) {
+		memcpy(&key, map, sizeof(key));
+
+		if (memcmp(key.magic, MODULE_MAGIC, sizeof(key.magic)) == 0 && key.mtime == mod->mtime && key.size == mod->size) {
+			forms = make_stack();
+			if (!decode_image((char*)map + sizeof(key), size - sizeof(key), forms, NULL)) {
+				free_stack(forms);
+				forms = NULL;
+			}
+		}
+	}
+
+	munmap(map, size);
+	free(cache);
+	return forms;
+}
+
+/* 
+Writes the cache file of a module, a cache that cannot be written is skipped.
+the cache is written aside and renamed, so readers never see a partial cache
+*/
+static void save_cached_forms(struct module* mod) {
+	char* 	cache 	= cache_path(mod->path);
+	char* 	temp 	= cache != NULL ? malloc(strlen(cache) + 64) : NULL;
+
+	if (temp == NULL) {
+		free(cache);
+		return;
+	}
+
+	sprintf(temp, "%s.%ld.%lx", cache, (long)getpid(), (unsigned long)&modules);
+	FILE* f = fopen(temp, "wb");
+	if (f != NULL) {
+		struct module_key key = {0};
+		memcpy(key.magic, MODULE_MAGIC, sizeof(key.magic));
+		key.mtime 	= mod->mtime;
+		key.size 	= mod->size;
+
+		fwrite(&key, sizeof(key), 1, f);
+		int e = write_image(f, mod->forms, NULL);
+
+		if (fclose(f) != 0 || e || rename(temp, cache) != 0)
+			remove(temp);
+	}
+
+	free(temp);
+	free(cache);
+}
+
+/* Parses the source of a module */
+static Stack* parse_module(struct module* mod) {
+	size_t 	size;
+	void* 	source = parus_map_file(mod->path, &size);
+
+	if (source == NULL)
+		return make_stack(); // an empty file
+
+	Stack* forms = parus_parse(source, size);
+	munmap(source, size);
+	return forms;
+}
+
+/*
+Evaluates a source file, its parsed forms are reused while the file does not change.
+returns 0 on success
+*/
+int parus_include(ParusVM* vm, char* path) {
+	struct stat st;
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+		fprintf(parus_errors(), "CANNOT INCLUDE FILE %s\n", path);
+		return 1;
+	}
+
+	path = parus_intern(path);
+	if (path == NULL)
+		return 1;
+
+	struct module* mod = modules;
+	while (mod != NULL && mod->path != path)
+		mod = mod->next;
+
+	if (mod == NULL) {
+		if ((mod = calloc(1, sizeof(struct module))) == NULL) {
+			fprintf(parus_errors(), "CANNOT INCLUDE FILE %s\n", path);
+			return 1;
+		}
+
+		mod->path 	= path;
+		mod->next 	= modules;
+		modules 	= mod;
+	}
+
+	if (mod->including) {
+		fprintf(parus_errors(), "CIRCULAR INCLUDE OF %s\n", path);
+		return 1;
+	}
+
+	// in nanoseconds, so a file changed twice within a second is still noticed
+	int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+	if (mod->forms == NULL || mod->mtime != mtime || mod->size != st.st_size) {
+		free_stack(mod->forms);
+		mod->mtime 	= mtime;
+		mod->size 	= st.st_size;
+
+		if ((mod->forms = load_cached_forms(mod)) == NULL) {
+			if ((mod->forms = parse_module(mod)) == NULL) {
+				fprintf(parus_errors(), "CANNOT INCLUDE FILE %s\n", path);
+				return 1;
+			}
+			save_cached_forms(mod);
+		}
+	}
+
+	// the forms are kept while they are evaluated, even if the file is included again meanwhile
+	mod->including = 1;
+	parus_evaluate_forms(vm, mod->forms);
+	mod->including = 0;
+
+	return 0;
+}
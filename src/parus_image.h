@@ -0,0 +1,43 @@
+/*
+CParus
+Copyright (C) 2020  Oren Daniel
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PARUS_IMAGE_H
+#define PARUS_IMAGE_H
+
+#include "parus.h"
+
+#define IMAGE_MAGIC 		"PARUSIMG"
+#define IMAGE_VERSION 		1
+#define IMAGE_BYTE_ORDER 	0x01020304
+
+#define MODULE_MAGIC 		"PARUSMOD"
+#define MODULE_CACHE_SUFFIX "c" // the cache of file.prs is file.prsc
+
+/*
+An image holds a lexicon and a stack.
+it refers to symbols and user ops by their index in tables at the start of the image,
+base operators are stored by their predefined name so an image does not depend on addresses
+*/
+int parus_save_image(ParusVM* vm, char* path);
+int parus_load_image(ParusVM* vm, char* path);
+int parus_include(ParusVM* vm, char* path);
+void parus_include_release();
+
+void* parus_map_file(char* path, size_t* size);
+
+#endif
@@ -17,122 +17,164 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "parus_predefined.h"
+#include "parus_image.h"
+#include "parus_alloc.h"
 #include <math.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
 
 #define READ_BUFFER 1024
+#define PFOR_MAX_WORKERS 64
 
-static decimal_t force_decimal(ParusData* pd) {
-	if (pd->type == INTEGER)
+// interned marker symbols, set by predefined_lexicon
+static char* case_symbol;
+static char* seq_symbol;
+
+static decimal_t force_decimal(ParusData pd) {
+	if (pd.type == INTEGER)
 		return (decimal_t)parusdata_tointeger(pd);
-	else if (pd->type == DECIMAL)
+	else if (pd.type == DECIMAL)
 		return parusdata_todecimal(pd);
 	else
 		return 0;
 }
 
-static char is_number(ParusData* pd) {
-	return pd != NULL && (pd->type == INTEGER || pd->type == DECIMAL);
+static char is_number(ParusData pd) {
+	return pd.type == INTEGER || pd.type == DECIMAL;
 }
 
-static char equivalent(ParusData* pd1, ParusData* pd2) {
-	if (pd1 == NULL || pd2 == NULL)
-		return pd1 == NULL && pd2 == NULL;
+static char equivalent(ParusData pd1, ParusData pd2) {
+	if (pd1.type == NONE || pd2.type == NONE)
+		return pd1.type == NONE && pd2.type == NONE;
 
-	if (pd1->type == SYMBOL && pd2->type == SYMBOL)
-		return strcmp(parusdata_getsymbol(pd1), parusdata_getsymbol(pd2)) == 0;
+	if (pd1.type == SYMBOL && pd2.type == SYMBOL)
+		return parusdata_getsymbol(pd1) == parusdata_getsymbol(pd2);
 
-	else if (pd1->type == INTEGER && pd2->type == INTEGER)
+	else if (pd1.type == INTEGER && pd2.type == INTEGER)
 		return parusdata_tointeger(pd1) == parusdata_tointeger(pd2);
 
 	else if (is_number(pd1) && is_number(pd2))
 		return force_decimal(pd1) == force_decimal(pd2);
 	
-	else if (pd1->type == QUOTED && pd2->type == QUOTED)
+	else if (pd1.type == QUOTED && pd2.type == QUOTED)
 		return equivalent(parusdata_unquote(pd1), parusdata_unquote(pd2));
 
+	else if (pd1.type == BASEOP && pd2.type == BASEOP)
+		return pd1.data.baseop == pd2.data.baseop;
+
+	else if (pd1.type == USEROP && pd2.type == USEROP)
+		return pd1.data.userop == pd2.data.userop;
+
 	else 
-		return pd1 == pd2;
+		return 0;
 }
 
-static ParusData* top_of_stack(void* stk, void* lex) {
-	return stack_pull(stk);
+static ParusData top_of_stack(ParusVM* vm) {
+	return stack_pull(vm->stack);
 }
 
 
 // BASIC
 // ----------------------------------------------------------------------------------------------------
 
-static int define(void* stk, void* lex) {
-	ParusData* sym = stack_pull(stk);
-	ParusData* val = stack_pull(stk);
+static int define(ParusVM* vm) {
+	ParusData sym = stack_pull(vm->stack);
+	ParusData val = stack_pull(vm->stack);
 
-	if (sym == NULL || val == NULL || sym->type != SYMBOL) {
+	if (val.type == NONE || sym.type != SYMBOL) {
 		free_parusdata(sym);
 		free_parusdata(val);
-		fprintf(stderr, "CAN ONLY BIND TO SYMBOLS\n");
+		fprintf(parus_errors(), "CAN ONLY BIND TO SYMBOLS\n");
 		return 1;
 	}
-	lexicon_define(lex, parusdata_getsymbol(sym), val);
+	lexicon_define(vm->lexicon, parusdata_getsymbol(sym), val);
 	free_parusdata(sym);
 	
 	return 0;
 }
 
-static int delete(void* stk, void* lex) {
-	ParusData* sym = stack_pull(stk);
-	if (sym == NULL || sym->type != SYMBOL) {
+/* 
+Binds a local, 'name let in a user op is compiled to a slot of its frame.
+applied anywhere else, as at the top level, it defines the name
+*/
+static int let(ParusVM* vm) {
+	return define(vm);
+}
+
+static int delete(ParusVM* vm) {
+	ParusData sym = stack_pull(vm->stack);
+	if (sym.type != SYMBOL) {
 		free_parusdata(sym);
-		fprintf(stderr, "CAN ONLY DELETE BINDED SYMBOLS\n");
+		fprintf(parus_errors(), "CAN ONLY DELETE BINDED SYMBOLS\n");
 		return 1;
 	}
-	lexicon_delete(lex, parusdata_getsymbol(sym));
+	lexicon_delete(vm->lexicon, parusdata_getsymbol(sym));
 	free_parusdata(sym);
 	return 0;
 }
 
-static int apply_top(void* stk, void* lex) {
-	parus_set_applier(&apply_top, &top_of_stack);
-	int e = parus_apply(NULL, stk, lex);
-	parus_set_applier(NULL, NULL);
-	if (e)
-		fprintf(stderr, "CANNOT APPLY TOP OF STACK\n");
+/* Pushes a mark of the lexicon, see lexicon_mark */
+static int mark(ParusVM* vm) {
+	stack_push(vm->stack, make_parus_integer(lexicon_mark(vm->lexicon)));
+	return 0;
+}
+
+/* Deletes everything defined since the mark on top of the stack */
+static int rollback(ParusVM* vm) {
+	ParusData pd = stack_pull(vm->stack);
+	if (pd.type != INTEGER || parusdata_tointeger(pd) < 0) {
+		free_parusdata(pd);
+		fprintf(parus_errors(), "CAN ONLY ROLLBACK TO A MARK\n");
+		return 1;
+	}
+	return lexicon_rollback(vm->lexicon, parusdata_tointeger(pd));
+}
+
+static int apply_top(ParusVM* vm) {
+	parus_set_applier(vm, &apply_top, &top_of_stack);
+	int e = parus_apply(vm, make_parus_none());
+	parus_set_applier(vm, NULL, NULL);
+	if (e && !vm->halted)
+		fprintf(parus_errors(), "CANNOT APPLY TOP OF STACK\n");
 
 	return e;
 
 }
 
-static int quotate(void* stk, void* lex) {
-	ParusData* pd = stack_pull(stk);
-	if (pd != NULL) {
-		stack_push(stk, make_parus_quote(pd));
+static int quotate(ParusVM* vm) {
+	ParusData pd = stack_pull(vm->stack);
+	if (pd.type != NONE) {
+		stack_push(vm->stack, make_parus_quote(pd));
 		return 0;
 	}
 	else {
-		fprintf(stderr, "NOTHING TO QUOTATE\n");
+		fprintf(parus_errors(), "NOTHING TO QUOTATE\n");
 		return 1;
 	}
 }
 
-static int peel(void* stk, void* lex) {
-	ParusData* sym = stack_pull(stk);
-	if (sym == NULL || sym->type != SYMBOL) {
+static int peel(ParusVM* vm) {
+	ParusData sym = stack_pull(vm->stack);
+	if (sym.type != SYMBOL) {
 		free_parusdata(sym);
-		fprintf(stderr, "CAN ONLY PEEL SYMBOLS\n");
+		fprintf(parus_errors(), "CAN ONLY PEEL SYMBOLS\n");
 		return 1;
 	}
 
-	stack_push(stk, lexicon_get(lex, parusdata_getsymbol(sym)));
+	ParusData binding = lexicon_get(vm->lexicon, parusdata_getsymbol(sym));
+	if (binding.type != NONE)
+		stack_push(vm->stack, binding);
 	free_parusdata(sym);
 	return 0;
 }
 
-static int if_op(void* stk, void* lex) {
-	ParusData* do_false	= stack_pull(stk);
-	ParusData* do_true 	= stack_pull(stk);
-	ParusData* cond		= stack_pull(stk);
+static int if_op(ParusVM* vm) {
+	ParusData do_false	= stack_pull(vm->stack);
+	ParusData do_true 	= stack_pull(vm->stack);
+	ParusData cond		= stack_pull(vm->stack);
 
-	if (cond == NULL || do_true == NULL || do_false == NULL) {
-		fprintf(stderr, "CAN NOT PREFORM IF OPERATION\n");
+	if (cond.type == NONE || do_true.type == NONE || do_false.type == NONE) {
+		fprintf(parus_errors(), "CAN NOT PREFORM IF OPERATION\n");
 		free_parusdata(cond);
 		free_parusdata(do_true);
 		free_parusdata(do_false);
@@ -141,19 +183,19 @@ static int if_op(void* stk, void* lex) {
 
 	char act = 1;
 
-	if (cond->type == INTEGER && parusdata_tointeger(cond) == 0)
+	if (cond.type == INTEGER && parusdata_tointeger(cond) == 0)
 		act = 0;
-	else if (cond->type == DECIMAL && parusdata_todecimal(cond) == 0)
+	else if (cond.type == DECIMAL && parusdata_todecimal(cond) == 0)
 		act = 0;
 
 	if (act) {
-		stack_push(stk, do_true);
+		stack_push(vm->stack, do_true);
 		free_parusdata(cond);
 		free_parusdata(do_false);
 		return 0;
 	}
 	else {
-		stack_push(stk, do_false);
+		stack_push(vm->stack, do_false);
 		free_parusdata(cond);
 		free_parusdata(do_true);
 		return 0;
@@ -161,88 +203,81 @@ static int if_op(void* stk, void* lex) {
 	}
 }
 
-static int eqv(void* stk, void* lex) {
-	ParusData* pd2 = stack_pull(stk);
-	ParusData* pd1 = stack_pull(stk);
+static int eqv(ParusVM* vm) {
+	ParusData pd2 = stack_pull(vm->stack);
+	ParusData pd1 = stack_pull(vm->stack);
 
-	if (pd1 == NULL || pd2 == NULL) {
+	if (pd1.type == NONE || pd2.type == NONE) {
 		free_parusdata(pd1);
 		free_parusdata(pd2);
-		fprintf(stderr, "ATTEMPT TO COMPARE NULLITY\n");
+		fprintf(parus_errors(), "ATTEMPT TO COMPARE NULLITY\n");
 		return 1;
 	}
 
-	stack_push(stk, make_parus_integer(equivalent(pd1, pd2)));
+	stack_push(vm->stack, make_parus_integer(equivalent(pd1, pd2)));
 	
 	free_parusdata(pd1);
 	free_parusdata(pd2);
 	return 0;
 }
 
-static int fetch(void* stk, void* lex) {
-	ParusData* pd = stack_pull(stk);
-	if (pd == NULL || pd->type != INTEGER) {
-		fprintf(stderr, "INDEX MUST BE AN INTEGER\n");
+static int fetch(ParusVM* vm) {
+	ParusData pd = stack_pull(vm->stack);
+	if (pd.type != INTEGER) {
+		fprintf(parus_errors(), "INDEX MUST BE AN INTEGER\n");
 		free_parusdata(pd);
 		return 1;
 	}
 
-	if (parusdata_tointeger(pd) < ((Stack*)stk)->size && parusdata_tointeger(pd) >= 0) {
-		ParusData* res = stack_get_at(stk, parusdata_tointeger(pd));
+	if (parusdata_tointeger(pd) < vm->stack->size && parusdata_tointeger(pd) >= 0) {
+		ParusData res = stack_get_at(vm->stack, parusdata_tointeger(pd));
 
-		stack_remove_at(stk, parusdata_tointeger(pd));
-		stack_push(stk, res);
-		free_parusdata(pd);
+		stack_remove_at(vm->stack, parusdata_tointeger(pd));
+		stack_push(vm->stack, res);
 		return 0;
 	}
 	else {
-		fprintf(stderr, "INDEX OUT OF RANGE\n");
-		free_parusdata(pd);
+		fprintf(parus_errors(), "INDEX OUT OF RANGE\n");
 		return 1;
 	}
 }
 
-static int fetch_copy(void* stk, void* lex) {
-	ParusData* pd = stack_pull(stk);
+static int fetch_copy(ParusVM* vm) {
+	ParusData pd = stack_pull(vm->stack);
 
-	if (pd == NULL || pd->type != INTEGER) {
-		fprintf(stderr, "INDEX MUST BE AN INTEGER\n");
+	if (pd.type != INTEGER) {
+		fprintf(parus_errors(), "INDEX MUST BE AN INTEGER\n");
 		free_parusdata(pd);
 		return 1;
 	}
-	if (parusdata_tointeger(pd) < ((Stack*)stk)->size && parusdata_tointeger(pd) >= 0) {
-		ParusData* res = stack_get_at(stk, parusdata_tointeger(pd));
-
-		stack_push(stk, res);
-		free_parusdata(pd);
+	if (parusdata_tointeger(pd) < vm->stack->size && parusdata_tointeger(pd) >= 0) {
+		stack_push(vm->stack, stack_get_at(vm->stack, parusdata_tointeger(pd)));
 		return 0;
 	}
 	else {
-		fprintf(stderr, "INDEX OUT OF RANGE\n");
-		free_parusdata(pd);
+		fprintf(parus_errors(), "INDEX OUT OF RANGE\n");
 		return 1;
 	}
 }
 
-static int length(void* stk, void* lex) {
-	stack_push(stk, make_parus_integer((integer_t) ((Stack*)stk)->size));
+static int length(ParusVM* vm) {
+	stack_push(vm->stack, make_parus_integer((integer_t) vm->stack->size));
 
 	return 0;
 }
 
-static int drop(void* stk, void* lex) {
-	ParusData* pd = stack_pull(stk);
-	free_parusdata(pd);
+static int drop(ParusVM* vm) {
+	free_parusdata(stack_pull(vm->stack));
 
 	return 0;
 }
 
-static int find(void* stk, void* lex) {
-	Stack* 		pstk 	= (Stack*)stk;
-	ParusData* 	pd 		= stack_pull(stk);
+static int find(ParusVM* vm) {
+	Stack* 		pstk 	= vm->stack;
+	ParusData 	pd 		= stack_pull(vm->stack);
 
-	if (pd == NULL) {
-		fprintf(stderr, "ATTEMPT TO COMPARE NULLITY\n");
+	if (pd.type == NONE) {
+		fprintf(parus_errors(), "ATTEMPT TO COMPARE NULLITY\n");
 		return 1;
 		
 	}
@@ -257,9 +292,9 @@ static int find(void* stk, void* lex) {
 	}
 
 	if (index != -1)
-		stack_push(stk, make_parus_integer(pstk->size - (index +1)));
+		stack_push(vm->stack, make_parus_integer(pstk->size - (index +1)));
 	else
-		stack_push(stk, make_parus_integer(-1));
+		stack_push(vm->stack, make_parus_integer(-1));
 
 	free_parusdata(pd);
 	return 0;
@@ -270,104 +305,107 @@ static int find(void* stk, void* lex) {
 // ----------------------------------------------------------------------------------------------------
 
 #define GET_TWO_NUMBERS 							\
-	ParusData* pd2 = stack_pull(stk); 				\
-	ParusData* pd1 = stack_pull(stk); 				\
+	ParusData pd2 = stack_pull(vm->stack); 			\
+	ParusData pd1 = stack_pull(vm->stack); 			\
 													\
 	if (!is_number(pd1) || !is_number(pd2)) { 		\
 		free_parusdata(pd1); 						\
 		free_parusdata(pd2); 						\
-		fprintf(stderr, "EXPECTED TWO NUMBERS\n"); 	\
+		fprintf(parus_errors(), "EXPECTED TWO NUMBERS\n"); 	\
 		return 1; 									\
 	}
 
-#define ARTH_FN(FUNCINT, FUNCDEC, OP) 						\
-	if (pd1->type == INTEGER && pd2->type == INTEGER) { 	\
-		integer_t a = parusdata_tointeger(pd1); 			\
-		integer_t b = parusdata_tointeger(pd2); 			\
-		stack_push(stk, FUNCINT(a OP b)); 					\
-	} 														\
-	else { 													\
-		decimal_t a = force_decimal(pd1); 					\
-		decimal_t b = force_decimal(pd2); 					\
-		stack_push(stk, FUNCDEC(a OP b)); 					\
-															\
-	} 														\
-	free_parusdata(pd1); 									\
-	free_parusdata(pd2);
-
-static int add(void* stk, void* lex) {
-	GET_TWO_NUMBERS;
-	ARTH_FN(make_parus_integer, make_parus_decimal, +);
+/*
+The operands are left in their slots and the result overwrites the lower one,
+two integers never leave the integer path, any decimal operand goes to the decimal path
+*/
+#define ARTH_FN(FUNCDEC, OP) 											\
+	Stack* pstk = vm->stack; 											\
+																		\
+	if (pstk->size < 2 || !is_number(pstk->items[pstk->size -1]) || 	\
+			!is_number(pstk->items[pstk->size -2])) { 					\
+		free_parusdata(stack_pull(vm->stack)); 							\
+		free_parusdata(stack_pull(vm->stack)); 							\
+		fprintf(parus_errors(), "EXPECTED TWO NUMBERS\n"); 						\
+		return 1; 														\
+	} 																	\
+																		\
+	ParusData* pd1 = &pstk->items[pstk->size -2]; 						\
+	ParusData* pd2 = &pstk->items[pstk->size -1]; 						\
+	pstk->size--; 														\
+																		\
+	if (pd1->type == INTEGER && pd2->type == INTEGER) 					\
+		pd1->data.integer = pd1->data.integer OP pd2->data.integer; 	\
+	else 																\
+		*pd1 = FUNCDEC(force_decimal(*pd1) OP force_decimal(*pd2));
+
+static int add(ParusVM* vm) {
+	ARTH_FN(make_parus_decimal, +);
 	return 0;
 }
 
-static int subtract(void* stk, void* lex) {
-	GET_TWO_NUMBERS;
-	ARTH_FN(make_parus_integer, make_parus_decimal, -);
+static int subtract(ParusVM* vm) {
+	ARTH_FN(make_parus_decimal, -);
 	return 0;
 }
 
-static int multiply(void* stk, void* lex) {
-	GET_TWO_NUMBERS;
-	ARTH_FN(make_parus_integer, make_parus_decimal, *);
+static int multiply(ParusVM* vm) {
+	ARTH_FN(make_parus_decimal, *);
 	return 0;
 }
 
-static int divide(void* stk, void* lex) {
+static int divide(ParusVM* vm) {
 	GET_TWO_NUMBERS;
 
-	if ((pd2->type == INTEGER && parusdata_tointeger(pd2) == 0) || 
-			(pd2->type == DECIMAL && parusdata_todecimal(pd2) == 0)) 
-		fprintf(stderr, "WARNING: DIVISION BY ZERO IS UNDEFINED BEHAVIOR\n");
+	if ((pd2.type == INTEGER && parusdata_tointeger(pd2) == 0) || 
+			(pd2.type == DECIMAL && parusdata_todecimal(pd2) == 0)) 
+		fprintf(parus_errors(), "WARNING: DIVISION BY ZERO IS UNDEFINED BEHAVIOR\n");
 
 	decimal_t a = force_decimal(pd1);
 	decimal_t b = force_decimal(pd2);
-	stack_push(stk, make_parus_decimal(a / b));
+	stack_push(vm->stack, make_parus_decimal(a / b));
 	
-	free_parusdata(pd1);
-	free_parusdata(pd2);
 	return 0;
 }
 
-static int powerof(void* stk, void* lex) {
+static int powerof(ParusVM* vm) {
 	GET_TWO_NUMBERS;
 
 	decimal_t a = force_decimal(pd1);
 	decimal_t b = force_decimal(pd2);
-	stack_push(stk, make_parus_decimal(pow(a, b)));
+	stack_push(vm->stack, make_parus_decimal(pow(a, b)));
 	
-	free_parusdata(pd1);
-	free_parusdata(pd2);
 	return 0;
 }
 
-static int equal(void* stk, void* lex) {
-	GET_TWO_NUMBERS;
-	ARTH_FN(make_parus_integer, make_parus_integer, ==);
+static int equal(ParusVM* vm) {
+	ARTH_FN(make_parus_integer, ==);
 	return 0;
 }
 
-static int less_than(void* stk, void* lex) {
-	GET_TWO_NUMBERS;
-	ARTH_FN(make_parus_integer, make_parus_integer, <);
+static int less_than(ParusVM* vm) {
+	ARTH_FN(make_parus_integer, <);
 	return 0;
 }
 
-static int greater_than(void* stk, void* lex) {
-	GET_TWO_NUMBERS;
-	ARTH_FN(make_parus_integer, make_parus_integer, >);
+static int greater_than(ParusVM* vm) {
+	ARTH_FN(make_parus_integer, >);
 	return 0;
 }
 
-static int round_value(void* stk, void* lex) {
-	ParusData* pd = stack_pull(stk);
-	if (!is_number(pd)) {
-		fprintf(stderr, "CANNOT ROUND A NON NUMERIC VALUE\n");
-		free_parusdata(pd);
+static int round_value(ParusVM* vm) {
+	Stack* pstk = vm->stack;
+
+	if (pstk->size == 0 || !is_number(pstk->items[pstk->size -1])) {
+		fprintf(parus_errors(), "CANNOT ROUND A NON NUMERIC VALUE\n");
+		free_parusdata(stack_pull(vm->stack));
 		return 1;
 	}
-	stack_push(stk, make_parus_integer(force_decimal(pd)));
-	free_parusdata(pd);
+
+	// an integer is already rounded
+	ParusData* pd = &pstk->items[pstk->size -1];
+	if (pd->type == DECIMAL)
+		*pd = make_parus_integer(parusdata_todecimal(*pd));
 	return 0;
 }
 
@@ -376,67 +414,67 @@ static int round_value(void* stk, void* lex) {
 // ----------------------------------------------------------------------------------------------------
 
 #define REFLECTION_TEMPLATE(COND) 						\
-	ParusData* pd = stack_pull(stk); 					\
-	if (pd != NULL && COND) {							\
-		stack_push(stk, pd); 							\
-		stack_push(stk, make_parus_integer(1)); 		\
+	ParusData pd = stack_pull(vm->stack); 				\
+	if (pd.type != NONE && (COND)) { 					\
+		stack_push(vm->stack, pd); 						\
+		stack_push(vm->stack, make_parus_integer(1)); 	\
 	} 													\
 	else { 												\
-		stack_push(stk, pd); 							\
-		stack_push(stk, make_parus_integer(0)); 		\
+		if (pd.type != NONE) 							\
+			stack_push(vm->stack, pd); 					\
+		stack_push(vm->stack, make_parus_integer(0)); 	\
 	}
 
-static int is_top_integer(void* stk, void* lex) {
-	REFLECTION_TEMPLATE(pd->type == INTEGER);
+static int is_top_integer(ParusVM* vm) {
+	REFLECTION_TEMPLATE(pd.type == INTEGER);
 	return 0;
 }
 
-static int is_top_decimal(void* stk, void* lex) {
-	REFLECTION_TEMPLATE(pd->type == DECIMAL);
+static int is_top_decimal(ParusVM* vm) {
+	REFLECTION_TEMPLATE(pd.type == DECIMAL);
 	return 0;
 
 }
 
-static int is_top_operator(void* stk, void* lex) {
-	REFLECTION_TEMPLATE(pd->type == USEROP || pd->type == BASEOP);
+static int is_top_operator(ParusVM* vm) {
+	REFLECTION_TEMPLATE(pd.type == USEROP || pd.type == BASEOP);
 	return 0;
 }
 
-static int is_top_symbol(void* stk, void* lex) {
-	REFLECTION_TEMPLATE(pd->type == SYMBOL);
+static int is_top_symbol(ParusVM* vm) {
+	REFLECTION_TEMPLATE(pd.type == SYMBOL);
 	return 0;
 }
 
-static int is_top_quoted(void* stk, void* lex) {
-	REFLECTION_TEMPLATE(pd->type == QUOTED);
+static int is_top_quoted(ParusVM* vm) {
+	REFLECTION_TEMPLATE(pd.type == QUOTED);
 	return 0;
 }
 
 // IO
 // ----------------------------------------------------------------------------------------------------
 
-static int out(void* stk, void* lex) {
-	ParusData* pd = stack_pull(stk);
-	if (pd == NULL) {
-		free_parusdata(pd);
-		fprintf(stderr, "CANNOT PRINT NULLITY\n");
+static int out(ParusVM* vm) {
+	ParusData pd = stack_pull(vm->stack);
+	if (pd.type == NONE) {
+		fprintf(parus_errors(), "CANNOT PRINT NULLITY\n");
 		return 1;
 	}
-	print_parusdata(pd);
+	print_parusdata(vm->out, pd);
 	free_parusdata(pd);
 	return 0;
 
 }
 
-static int outln(void* stk, void* lex) {
-	int ret = out(stk, lex);
+static int outln(ParusVM* vm) {
+	int ret = out(vm);
 	if (ret == 0)
-		printf("\n");
+		fprintf(vm->out, "\n");
 	return ret;
 }
 
 /* reader evaluates the expression given */
-static int read(void* stk, void* lex) {
+static int read(ParusVM* vm) {
 	int c;
 	int i = 1;
 
@@ -453,27 +491,38 @@ static int read(void* stk, void* lex) {
 		}
 	}
 	if (buffer[i -1] != QUOTE_CHAR)
-		parus_evaluate(buffer, stk, lex);
+		parus_evaluate(vm, buffer, i);
 
 	return 0;
 }
 
-static int getcharacter(void* stk, void* lex) {
-	stack_push(stk, make_parus_integer(getc(stdin)));
+/* evaluates the file named by the symbol at the top of the stack */
+static int include(ParusVM* vm) {
+	ParusData pd = stack_pull(vm->stack);
+	if (pd.type != SYMBOL) {
+		fprintf(parus_errors(), "INCLUDE EXPECTS A FILE NAME\n");
+		free_parusdata(pd);
+		return 1;
+	}
+
+	return parus_include(vm, parusdata_getsymbol(pd));
+}
+
+static int getcharacter(ParusVM* vm) {
+	stack_push(vm->stack, make_parus_integer(getc(stdin)));
 	return 0;
 }
 
-static int putcharacter(void* stk, void* lex) {
-	ParusData* pd = stack_pull(stk);
+static int putcharacter(ParusVM* vm) {
+	ParusData pd = stack_pull(vm->stack);
 
-	if (pd == NULL || pd->type != INTEGER) {
-		fprintf(stderr, "CHAR CODE MUST BE AN INTEGER\n");
+	if (pd.type != INTEGER) {
+		fprintf(parus_errors(), "CHAR CODE MUST BE AN INTEGER\n");
 		free_parusdata(pd);
 		return 1;
 	}
 
-	fputc(parusdata_tointeger(pd), stdout);
-	free_parusdata(pd);
+	fputc(parusdata_tointeger(pd), vm->out);
 
 	return 0;
 }
@@ -482,44 +531,41 @@ static int putcharacter(void* stk, void* lex) {
 // OPTIONALS
 // ----------------------------------------------------------------------------------------------------
 
-static int dpl(void* stk, void* lex) {
-	ParusData* pd = stack_pull(stk);
+static int dpl(ParusVM* vm) {
+	ParusData pd = stack_pull(vm->stack);
 	
-	if (pd == NULL) {
-		fprintf(stderr, "NOTHING TO DUPLICATE\n");
+	if (pd.type == NONE) {
+		fprintf(parus_errors(), "NOTHING TO DUPLICATE\n");
 		return 1;
 	}
 
 	
-	stack_push(stk, pd);
-	stack_push(stk, parusdata_copy(pd));
+	stack_push(vm->stack, pd);
+	stack_push(vm->stack, parusdata_copy(pd));
 
 	return 0;
 }
 
-static int setat(void* stk, void* lex) {
-	ParusData* index = stack_pull(stk);
-	ParusData* value = stack_pull(stk);
+static int setat(ParusVM* vm) {
+	ParusData index = stack_pull(vm->stack);
+	ParusData value = stack_pull(vm->stack);
 
-	if (index == NULL || value == NULL || index->type != INTEGER) {
-		fprintf(stderr, "INVALID PARAMTERS GIVEN TO SETAT\n");
+	if (value.type == NONE || index.type != INTEGER) {
+		fprintf(parus_errors(), "INVALID PARAMTERS GIVEN TO SETAT\n");
 		free_parusdata(index);
 		free_parusdata(value);
 		return 1;
 
 	}
 
-	Stack* pstk	= (Stack*)stk;
+	Stack* pstk	= vm->stack;
 	int i 		= pstk->size - (parusdata_tointeger(index) +1);
 	if (i < pstk->size && i >= 0) {
-		ParusData* old = pstk->items[i];
-		free_parusdata(old);
+		free_parusdata(pstk->items[i]);
 		pstk->items[i] = value;
-		free_parusdata(index);
 	}
 	else {
-		fprintf(stderr, "INDEX OUT OF RANGE\n");
-		free_parusdata(index);
+		fprintf(parus_errors(), "INDEX OUT OF RANGE\n");
 		free_parusdata(value);
 		return 1;
 	}
@@ -528,22 +574,21 @@ static int setat(void* stk, void* lex) {
 }
 
 
-static int for_op(void* stk, void* lex) {
+static int for_op(ParusVM* vm) {
 
-	ParusData* fn 	= stack_pull(stk);
-	ParusData* inc 	= stack_pull(stk);
-	ParusData* cmp 	= stack_pull(stk);
-	ParusData* max 	= stack_pull(stk);
-	ParusData* min 	= stack_pull(stk);
-	ParusData* sym 	= stack_pull(stk);
+	ParusData fn 	= stack_pull(vm->stack);
+	ParusData inc 	= stack_pull(vm->stack);
+	ParusData cmp 	= stack_pull(vm->stack);
+	ParusData max 	= stack_pull(vm->stack);
+	ParusData min 	= stack_pull(vm->stack);
+	ParusData sym 	= stack_pull(vm->stack);
 
-	if (fn == NULL || inc == NULL || cmp == NULL || max == NULL || min == NULL || sym == NULL 
-			|| inc->type != INTEGER || min->type != INTEGER || max->type != INTEGER || 
-			sym->type != SYMBOL || 
-			!(cmp->type == SYMBOL || cmp->type == USEROP || cmp->type == BASEOP)) {
+	if (fn.type == NONE || inc.type != INTEGER || min.type != INTEGER || max.type != INTEGER || 
+			sym.type != SYMBOL || 
+			!(cmp.type == SYMBOL || cmp.type == USEROP || cmp.type == BASEOP)) {
 		
-		fprintf(stderr, "WRONG TYPES OF PARAMETERS GIVEN\n");
-		fprintf(stderr, "SYMBOL MIN MAX CMP INC FN\n");
+		fprintf(parus_errors(), "WRONG TYPES OF PARAMETERS GIVEN\n");
+		fprintf(parus_errors(), "SYMBOL MIN MAX CMP INC FN\n");
 		free_parusdata(fn);
 		free_parusdata(inc);
 		free_parusdata(cmp);
@@ -553,26 +598,38 @@ static int for_op(void* stk, void* lex) {
 		return 1;
 	}
 	
-	int i = parusdata_tointeger(min);
+	integer_t 		i 		= parusdata_tointeger(min);
+	char* 			name 	= parusdata_getsymbol(sym);
+	struct binding* bnd 	= NULL;
+	size_t 			version = 0;
 
 	while (1) {
-		stack_push(stk, make_parus_integer(i));
-		stack_push(stk, parusdata_copy(max));
-		parus_apply(parusdata_copy(cmp), stk, lex);
-
+		stack_push(vm->stack, make_parus_integer(i));
+		stack_push(vm->stack, max);
+		if (parus_apply(vm, parusdata_copy(cmp)) && vm->halted)
+			break;
 
-		ParusData* 	cond 		= stack_pull(stk);
+		ParusData 	cond 		= stack_pull(vm->stack);
 		int 		cond_int 	= parusdata_tointeger(cond);
 
 		free_parusdata(cond);
 
 
 		if (cond_int != 0) {
-			lexicon_define(lex, parusdata_getsymbol(sym), make_parus_integer(i));
-
-			parus_apply(parusdata_copy(fn), stk, lex);
-
-			lexicon_delete(lex, parusdata_getsymbol(sym));
+			// the iterator is bound once and set in place while the lexicon is unchanged
+			if (bnd != NULL && vm->lexicon->version == version)
+				bnd->value = make_parus_integer(i);
+			else {
+				if (bnd != NULL)
+					lexicon_delete(vm->lexicon, name);
+
+				lexicon_define(vm->lexicon, name, make_parus_integer(i));
+				bnd 	= lexicon_lookup(vm->lexicon, name);
+				version = vm->lexicon->version;
+			}
+
+			if (parus_apply(vm, parusdata_copy(fn)) && vm->halted)
+				break;
 			i += parusdata_tointeger(inc);		
 		}
 		else
@@ -580,48 +637,232 @@ static int for_op(void* stk, void* lex) {
 		
 	}
 
+	if (bnd != NULL)
+		lexicon_delete(vm->lexicon, name);
+
 	free_parusdata(fn);
-	free_parusdata(inc);
 	free_parusdata(cmp);
-	free_parusdata(min);
-	free_parusdata(max);
 	free_parusdata(sym);
-	return 0;
+	return vm->halted;
+
+}
+
+/* 
+The loops below are run by the interpreter, see parus_define_loop.
+called directly they are applied as base operators, which starts them in the interpreter
+*/
+static int times_op(ParusVM* vm) {
+	return parus_apply(vm, make_parus_baseop(&times_op));
+}
 
+static int range_op(ParusVM* vm) {
+	return parus_apply(vm, make_parus_baseop(&range_op));
 }
 
+static int while_op(ParusVM* vm) {
+	return parus_apply(vm, make_parus_baseop(&while_op));
+}
+
+static int until_op(ParusVM* vm) {
+	return parus_apply(vm, make_parus_baseop(&until_op));
+}
+
+// a share of the range of a parallel for
+struct pfor_share {
+	ParusVM* 	parent;
+	char* 		sym;
+	integer_t 	from;
+	integer_t 	to;
+	ParusData 	fn;
+	ParusData 	reducer;
+	FILE* 		errors; // diagnostics of the parent thread, shared by its workers
+
+	Stack* 		result; // the stack left by the share, NULL if it could not run
+	size_t 		fired[FUSIONS_MAX];
+	char 		halted; // quit was applied by the share
+};
+
+/*
+Runs a share on a private interpreter, the values of the parent are cloned and only read.
+the results of consecutive iterations are combined with the reducer as soon as they are pushed
+*/
+static void run_share(struct pfor_share* sh) {
+	ParusVM* vm = make_parus_vm(lexicon_clone(sh->parent->lexicon));
+	if (vm == NULL)
+		return;
+
+	vm->out 	= sh->parent->out;
+	vm->pooled 	= sh->parent->pooled;
+
+	ParusData fn 		= parusdata_clone(sh->fn);
+	ParusData reducer 	= parusdata_clone(sh->reducer);
+
+	struct binding* bnd 	= NULL;
+	size_t 			version = 0;
+
+	for (integer_t i = sh->from; i < sh->to; i++) {
+		// the iterator is set in place as long as nothing was defined or deleted since it was bound
+		if (bnd != NULL && vm->lexicon->version == version)
+			bnd->value = make_parus_integer(i);
+		else {
+			if (bnd != NULL)
+				lexicon_delete(vm->lexicon, sh->sym);
+
+			lexicon_define(vm->lexicon, sh->sym, make_parus_integer(i));
+			bnd 	= lexicon_lookup(vm->lexicon, sh->sym);
+			version = vm->lexicon->version;
+		}
+
+		parus_apply(vm, parusdata_copy(fn));
+		if (i > sh->from)
+			parus_apply(vm, parusdata_copy(reducer));
+
+		if (vm->halted)
+			break;
+	}
+
+	if (bnd != NULL)
+		lexicon_delete(vm->lexicon, sh->sym);
+
+	free_parusdata(fn);
+	free_parusdata(reducer);
+
+	sh->result = vm->stack;
+	vm->stack = make_stack();
+	memcpy(sh->fired, vm->fired, sizeof(sh->fired));
+	sh->halted = vm->halted;
+	free_parus_vm(vm);
+}
+
+static void* pfor_worker(void* arg) {
+	struct pfor_share* sh = arg;
+
+	parus_set_errors(sh->errors);
+	run_share(sh);
+	parus_include_release();
+	parus_alloc_release();
+	return NULL;
+}
+
+/*
+Parallel for, SYMBOL MIN MAX FN REDUCER.
+FN is applied for MIN <= SYMBOL < MAX, the range is split between workers with private stacks.
+the stacks are combined in order with REDUCER, which must be associative
+*/
+static int pfor_op(ParusVM* vm) {
+	ParusData reducer 	= stack_pull(vm->stack);
+	ParusData fn 		= stack_pull(vm->stack);
+	ParusData max 		= stack_pull(vm->stack);
+	ParusData min 		= stack_pull(vm->stack);
+	ParusData sym 		= stack_pull(vm->stack);
+
+	if (fn.type == NONE || reducer.type == NONE || min.type != INTEGER || max.type != INTEGER || 
+			sym.type != SYMBOL) {
+
+		fprintf(parus_errors(), "WRONG TYPES OF PARAMETERS GIVEN\n");
+		fprintf(parus_errors(), "SYMBOL MIN MAX FN REDUCER\n");
+		free_parusdata(reducer);
+		free_parusdata(fn);
+		free_parusdata(max);
+		free_parusdata(min);
+		free_parusdata(sym);
+		return 1;
+	}
+
+	integer_t from 	= parusdata_tointeger(min);
+	integer_t to 	= parusdata_tointeger(max);
+
+	long workers = get_nprocs();
+	if (workers < 1)
+		workers = 1;
+	if (workers > PFOR_MAX_WORKERS)
+		workers = PFOR_MAX_WORKERS;
+	if (to > from && workers > to - from)
+		workers = to - from;
+
+	struct pfor_share 	shares[PFOR_MAX_WORKERS];
+	pthread_t 			threads[PFOR_MAX_WORKERS];
+	int 				started = 0;
+
+	if (to > from) {
+		integer_t count = to - from;
+
+		for (int w = 0; w < workers; w++) {
+			shares[w].parent 	= vm;
+			shares[w].sym 		= parusdata_getsymbol(sym);
+			shares[w].from 		= from + (count / workers) * w + (w < count % workers ? w : count % workers);
+			shares[w].to 		= shares[w].from + count / workers + (w < count % workers);
+			shares[w].fn 		= fn;
+			shares[w].reducer 	= reducer;
+			shares[w].errors 	= parus_errors();
+			shares[w].result 	= NULL;
+			shares[w].halted 	= 0;
+		}
+
+		// the first share runs on the calling thread, as do shares whose thread could not start
+		for (started = 1; started < workers; started++)
+			if (pthread_create(&threads[started], NULL, &pfor_worker, &shares[started]) != 0)
+				break;
+
+		run_share(&shares[0]);
+		for (int w = started; w < workers; w++)
+			run_share(&shares[w]);
+
+		for (int w = 1; w < started; w++)
+			pthread_join(threads[w], NULL);
+	}
+
+	for (int w = 0; w < workers && to > from; w++) {
+		if (shares[w].result == NULL) {
+			fprintf(parus_errors(), "CANNOT RUN PARALLEL SHARE\n");
+			continue;
+		}
+
+		for (size_t i = 0; i < shares[w].result->size; i++)
+			stack_push(vm->stack, shares[w].result->items[i]);
+
+		shares[w].result->size = 0;
+		free_stack(shares[w].result);
+
+		if (w > 0)
+			parus_apply(vm, parusdata_copy(reducer));
+
+		for (int f = 0; f < FUSIONS_MAX; f++)
+			vm->fired[f] += shares[w].fired[f];
+
+		// a share which quit halts the parent as well
+		if (shares[w].halted)
+			vm->halted = 1;
+	}
+
+	free_parusdata(reducer);
+	free_parusdata(fn);
+	free_parusdata(sym);
+	return vm->halted;
+}
 
-static int end_case_op(void* stk, void* lex) {
-	Stack* 		tmp 		= make_stack();
-	ParusData* 	case_sym 	= make_parus_symbol("case");
 
-	ParusData* 	pd;
+static int end_case_op(ParusVM* vm) {
+	Stack* 		tmp = make_stack();
+	ParusData 	pd;
 	
-	while  (!equivalent((pd = stack_pull(stk)), case_sym)){
-		if (pd == NULL) {
-			fprintf(stderr, "NO CASE LABEL FOUND\n");
+	while (!((pd = stack_pull(vm->stack)).type == SYMBOL && parusdata_getsymbol(pd) == case_symbol)) {
+		if (pd.type == NONE) {
+			fprintf(parus_errors(), "NO CASE LABEL FOUND\n");
 			
 			// Undo
-			ParusData* back_pd;
-			while ((back_pd = stack_pull(tmp)) != NULL)
-				stack_push(stk, back_pd);
+			while (tmp->size > 0)
+				stack_push(vm->stack, stack_pull(tmp));
 
 			free_stack(tmp);
-			free_parusdata(back_pd);
-			free_parusdata(pd);
-			free_parusdata(case_sym);
 			return 1;
 
 		}
 		stack_push(tmp, pd);
 	}
 
-	// marker and marker representation no longer needed
-	free_parusdata(pd);
-	free_parusdata(case_sym);
-
 	if (tmp->size % 2 != 0) {
-		fprintf(stderr, "CASE EXPECTS EVEN NUMBER OF ARGUEMENTS\n");
+		fprintf(parus_errors(), "CASE EXPECTS EVEN NUMBER OF ARGUEMENTS\n");
 		free_stack(tmp);
 		return 1;
 	}
@@ -630,38 +871,42 @@ static int end_case_op(void* stk, void* lex) {
 		return 0;
 	}
 	
-	ParusData* cnd = NULL;
-	ParusData* exp = NULL;
-	while ((cnd = stack_pull(tmp)) != NULL) {
-		parus_apply(cnd, stk, lex);
+	while (tmp->size > 0) {
+		parus_apply(vm, stack_pull(tmp));
+		if (vm->halted)
+			break;
 
-		ParusData* res = stack_pull(stk);
-		char act = 1;
+		ParusData 	res = stack_pull(vm->stack);
+		char 		act = 1;
 
-		if (res->type == INTEGER && parusdata_tointeger(res) == 0)
+		if (res.type == INTEGER && parusdata_tointeger(res) == 0)
 			act = 0;
-		else if (res->type == DECIMAL && parusdata_todecimal(res) == 0)
+		else if (res.type == DECIMAL && parusdata_todecimal(res) == 0)
 			act = 0;
 		
 		free_parusdata(res);
 
-		exp = stack_pull(tmp);
+		ParusData exp = stack_pull(tmp);
 		if (act) {
-			parus_apply(exp, stk, lex);
+			parus_apply(vm, exp);
 			break;
 		}
 		else 
 			free_parusdata(exp);
-
-		if (tmp->size == 0) break;
 	}
 
 	free_stack(tmp);
 
-	return 0;
+	return vm->halted;
 }
 
-static int quit(void* stk, void* lex) {
+/* Ends the process, in a worker pool only the evaluation of the running job ends */
+static int quit(ParusVM* vm) {
+	if (vm->pooled) {
+		vm->halted = 1;
+		return 1;
+	}
+
 	exit(EXIT_SUCCESS);
 	return 0;
 
@@ -670,111 +915,271 @@ static int quit(void* stk, void* lex) {
 // DEBUGGING AND HELP
 // ----------------------------------------------------------------------------------------------------
 
-static int stkprint(void* stk, void* lex) {
-	print_stack(stk);
+static int stkprint(ParusVM* vm) {
+	print_stack(vm->out, vm->stack);
 	return 0;
 }
 
-static int lexprint(void* stk, void* lex) {
-	print_lexicon(lex);
+static int lexprint(ParusVM* vm) {
+	print_lexicon(vm->out, vm->lexicon);
 	return 0;
 }
 
-static int help(void* stk, void* lex) {
-	printf(HELP_MESSAGE);
+static int fusionprint(ParusVM* vm) {
+	print_fusions(vm->out, vm);
+	return 0;
+}
+
+static int help(ParusVM* vm) {
+	fprintf(vm->out, HELP_MESSAGE);
 	return 0;
 }
 
 // EXPERIMENTAL
 // ----------------------------------------------------------------------------------------------------
 
-static int seqterm(void* stk, void* lex) {
-	Stack* 		pstk 		= (Stack*)stk;
-	ParusData* 	seq_sym 	= make_parus_symbol("seq");
-	int 		index 		= -1;
+static int seqterm(ParusVM* vm) {
+	Stack* 	pstk 	= vm->stack;
+	int 	index 	= -1;
 
 	for (int i = pstk->size -1; i >= 0; i--) {
-		if (equivalent(seq_sym, pstk->items[i])) {
+		if (pstk->items[i].type == SYMBOL && parusdata_getsymbol(pstk->items[i]) == seq_symbol) {
 			index = i;
 			break;
 		}
 	}
+
 	if (index < 0) {
-		fprintf(stderr, "NO SEQUENCE LABEL FOUND\n");
-		free_parusdata(seq_sym);
+		fprintf(parus_errors(), "NO SEQUENCE LABEL FOUND\n");
 		return 1;
 	}
 
-	index = pstk->size - (index +1);
-	stack_remove_at(stk, index--);
-	ParusData* op = make_parus_userop();
+	// the items above the label become the instructions at once, then the label is dropped
+	ParusData op = make_parus_userop();
+	parus_insert_slice(&op, pstk, 0, pstk->size - (index +1));
+	stack_remove_at(pstk, 0);
 
-	for (int i = index; i >= 0; i--) {
-		ParusData* instr = stack_get_at(stk, i);
-		parus_insert_instr(op, instr);
-		stack_remove_at(stk, i);
-	}
-	
-	stack_push(stk, op);
+	stack_push(pstk, op);
 	return 0;
 }
 
+// FUSIONS
+// ----------------------------------------------------------------------------------------------------
+
+/*
+Native replacements for common sequences of words,
+they return -1 when the stack does not fit and the words are applied as written
+*/
+
+// dpl *
+static int square(ParusVM* vm, ParusData literal) {
+	(void)literal;
+	Stack* pstk = vm->stack;
+	if (pstk->size == 0)
+		return -1;
+
+	ParusData* top = &pstk->items[pstk->size -1];
+	if (top->type == INTEGER)
+		top->data.integer *= top->data.integer;
+	else if (top->type == DECIMAL)
+		top->data.decimal *= top->data.decimal;
+	else
+		return -1;
+
+	return 0;
+}
+
+// # +
+static int add_literal(ParusVM* vm, ParusData literal) {
+	Stack* pstk = vm->stack;
+	if (pstk->size == 0)
+		return -1;
+
+	ParusData* top = &pstk->items[pstk->size -1];
+	if (top->type == INTEGER)
+		top->data.integer += parusdata_tointeger(literal);
+	else if (top->type == DECIMAL)
+		top->data.decimal += parusdata_tointeger(literal);
+	else
+		return -1;
+
+	return 0;
+}
+
+// if !, the chosen branch is applied by the interpreter
+static int select_branch(ParusVM* vm, ParusData literal) {
+	(void)literal;
+	if (vm->stack->size < 3)
+		return -1;
+
+	return if_op(vm);
+}
+
+// 0 @
+static int fetch_top(ParusVM* vm, ParusData literal) {
+	(void)literal;
+	return vm->stack->size > 0 ? 0 : -1;
+}
+
+// 1 @.
+static int over(ParusVM* vm, ParusData literal) {
+	(void)literal;
+	Stack* pstk = vm->stack;
+	if (pstk->size < 2)
+		return -1;
+
+	stack_push(vm->stack, parusdata_copy(pstk->items[pstk->size -2]));
+	return 0;
+}
+
+// length 1 - @
+static int bring_bottom(ParusVM* vm, ParusData literal) {
+	(void)literal;
+	Stack* pstk = vm->stack;
+	if (pstk->size == 0)
+		return -1;
+
+	ParusData bottom = pstk->items[0];
+	memmove(pstk->items, pstk->items +1, (pstk->size -1) * sizeof(ParusData));
+	pstk->items[pstk->size -1] = bottom;
+	return 0;
+}
+
+static const struct {
+	char* 		pattern;
+	fusedop_t 	op;
+	char 		applies;
+} fused[] = {
+	{ "length 1 - @", &bring_bottom, 0 },
+	{ "dpl *", &square, 0 },
+	{ "if !", &select_branch, 1 },
+	{ "0 @", &fetch_top, 0 },
+	{ "1 @.", &over, 0 },
+	{ "# +", &add_literal, 0 },
+};
+
 // PREDEFINED LEXICON
 // ----------------------------------------------------------------------------------------------------
 
-Lexicon* predefined_lexicon() {
-	Lexicon* lex = make_lexicon();
+// words without an operator are markers, they evaluate to their own symbol
+static const struct {
+	char* 		name;
+	baseop_t 	op;
+} predefined[] = {
+	{ "define", &define },
+	{ "let", &let },
+	{ "delete", &delete },
+	{ "mark", &mark },
+	{ "rollback-to-mark", &rollback },
+	{ "!", &apply_top },
+	{ "quotate", &quotate },
+	{ "peel", &peel },
+	{ "if", &if_op },
+	{ "eqv?", &eqv },
+	{ "@", &fetch },
+	{ "@.", &fetch_copy },
+	{ "length", &length },
+	{ "drop", &drop },
+	{ "find", &find },
+
+	{ "+", &add },
+	{ "-", &subtract },
+	{ "*", &multiply },
+	{ "/", &divide },
+	{ "^", &powerof },
+	{ "=", &equal },
+	{ "<", &less_than },
+	{ ">", &greater_than },
+	{ "round", &round_value },
+
+	{ "integer?", &is_top_integer },
+	{ "decimal?", &is_top_decimal },
+	{ "operator?", &is_top_operator },
+	{ "symbol?", &is_top_symbol },
+	{ "quoted?", &is_top_quoted },
+
+	{ "out", &out },
+	{ "outln", &outln },
+	{ "read", &read },
+	{ "include", &include },
+	{ "getc", &getcharacter },
+	{ "putc", &putcharacter },
+
+	{ "dpl", &dpl },
+	{ "setat", &setat },
+	{ "for", &for_op },
+	{ "pfor", &pfor_op },
+	{ "times", &times_op },
+	{ "range", &range_op },
+	{ "while", &while_op },
+	{ "until", &until_op },
+	{ "case", NULL },
+	{ "else", NULL },
+	{ "end-case", &end_case_op },
+	{ "quit", &quit },
+
+	{ "?stk", &stkprint },
+	{ "?lex", &lexprint },
+	{ "?help", &help },
+	{ "?fusions", &fusionprint },
+
+	{ "seq", NULL },
+	{ "end-seq", &seqterm },
+};
+
+/* Returns the name of a predefined base operator, or NULL */
+char* predefined_name(baseop_t op) {
+	for (int i = 0; i < sizeof(predefined) / sizeof(predefined[0]); i++)
+		if (predefined[i].op == op && op != NULL)
+			return predefined[i].name;
+
+	return NULL;
+}
+
+/* Returns the predefined base operator of a name, or NULL */
+baseop_t predefined_op(char* name) {
+	for (int i = 0; i < sizeof(predefined) / sizeof(predefined[0]); i++)
+		if (strcmp(predefined[i].name, name) == 0)
+			return predefined[i].op;
+
+	return NULL;
+}
 
-	lexicon_define(lex, "define", make_parus_baseop(&define));
-	lexicon_define(lex, "delete", make_parus_baseop(&delete));
-	lexicon_define(lex, "!", make_parus_baseop(&apply_top));
-	lexicon_define(lex, "quotate", make_parus_baseop(&quotate));
-	lexicon_define(lex, "peel", make_parus_baseop(&peel));
-	lexicon_define(lex, "if", make_parus_baseop(&if_op));
-	lexicon_define(lex, "eqv?", make_parus_baseop(&eqv));
-	lexicon_define(lex, "@", make_parus_baseop(&fetch));
-	lexicon_define(lex, "@.", make_parus_baseop(&fetch_copy));
-	lexicon_define(lex, "length", make_parus_baseop(&length));
-	lexicon_define(lex, "drop", make_parus_baseop(&drop));
-	lexicon_define(lex, "find", make_parus_baseop(&find));
-
-	lexicon_define(lex, "+", make_parus_baseop(&add));
-	lexicon_define(lex, "-", make_parus_baseop(&subtract));
-	lexicon_define(lex, "*", make_parus_baseop(&multiply));
-	lexicon_define(lex, "/", make_parus_baseop(&divide));
-	lexicon_define(lex, "^", make_parus_baseop(&powerof));
-	lexicon_define(lex, "=", make_parus_baseop(&equal));
-	lexicon_define(lex, "<", make_parus_baseop(&less_than));
-	lexicon_define(lex, ">", make_parus_baseop(&greater_than));
-	lexicon_define(lex, "round", make_parus_baseop(&round_value));
-
-	lexicon_define(lex, "integer?", make_parus_baseop(&is_top_integer));
-	lexicon_define(lex, "decimal?", make_parus_baseop(&is_top_decimal));
-	lexicon_define(lex, "operator?", make_parus_baseop(&is_top_operator));
-	lexicon_define(lex, "symbol?", make_parus_baseop(&is_top_symbol));
-	lexicon_define(lex, "quoted?", make_parus_baseop(&is_top_quoted));
-
-	lexicon_define(lex, "out", make_parus_baseop(&out));
-	lexicon_define(lex, "outln", make_parus_baseop(&outln));
-	lexicon_define(lex, "read", make_parus_baseop(&read));
-	lexicon_define(lex, "getc", make_parus_baseop(&getcharacter));
-	lexicon_define(lex, "putc", make_parus_baseop(&putcharacter));
-
-	lexicon_define(lex, "dpl", make_parus_baseop(&dpl));
-	lexicon_define(lex, "setat", make_parus_baseop(&setat));
-	lexicon_define(lex, "for", make_parus_baseop(&for_op));
-	lexicon_define(lex, "case", make_parus_quote(make_parus_symbol("case")));
-	lexicon_define(lex, "else", make_parus_quote(make_parus_symbol("else")));
-	lexicon_define(lex, "end-case", make_parus_baseop(&end_case_op));
-	lexicon_define(lex, "quit", make_parus_baseop(&quit));
-
-	lexicon_define(lex, "?stk", make_parus_baseop(&stkprint));
-	lexicon_define(lex, "?lex", make_parus_baseop(&lexprint));
-	lexicon_define(lex, "?help", make_parus_baseop(&help));
-
-	lexicon_define(lex, "seq", make_parus_quote(make_parus_symbol("seq")));
-	lexicon_define(lex, "end-seq", make_parus_baseop(&seqterm));
+static pthread_once_t predefined_once = PTHREAD_ONCE_INIT;
 
+static void define_predefined(Lexicon* lex) {
+	for (int i = 0; i < sizeof(predefined) / sizeof(predefined[0]); i++) {
+		char* name = parus_intern(predefined[i].name);
+
+		if (predefined[i].op != NULL)
+			lexicon_define(lex, name, make_parus_baseop(predefined[i].op));
+		else
+			lexicon_define(lex, name, make_parus_quote(make_parus_symbol(name)));
+	}
+}
+
+/* Sets up the markers and fusions once, before any thread makes a lexicon */
+static void init_predefined() {
+	case_symbol = parus_intern("case");
+	seq_symbol 	= parus_intern("seq");
+
+	for (int i = 0; i < sizeof(fused) / sizeof(fused[0]); i++)
+		parus_define_fusion(fused[i].pattern, fused[i].op, fused[i].applies);
+
+	parus_define_apply(&apply_top);
+	parus_define_let("let", &let);
+	parus_define_case("case", "end-case", &end_case_op);
+	parus_define_loop(LOOP_TIMES, &times_op);
+	parus_define_loop(LOOP_RANGE, &range_op);
+	parus_define_loop(LOOP_WHILE, &while_op);
+	parus_define_loop(LOOP_UNTIL, &until_op);
+}
+
+Lexicon* predefined_lexicon() {
+	pthread_once(&predefined_once, &init_predefined);
+
+	Lexicon* lex = make_lexicon();
+	define_predefined(lex);
 	return lex;
 
 }
@@ -22,6 +22,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "parus.h"
 
 
-Lexicon* predefined_lexicon();
+Lexicon* 	predefined_lexicon();
+char* 		predefined_name(baseop_t op);
+baseop_t 	predefined_op(char* name);
 
 #endif
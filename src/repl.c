@@ -20,6 +20,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "parus.h"
 #include "parus_predefined.h"
+#include "parus_image.h"
+#include "parus_batch.h"
+
+#include <sys/mman.h>
 
 #ifdef USE_READLINE
 
@@ -50,25 +54,22 @@ char* readline(const char* prompt) {
 
 #endif
 
-char* read_file(FILE* f) {
-	int 	size 	= 0;
-	int 	max 	= TEXT_BUFFER_SIZE;
-	char* 	text 	= calloc(max, sizeof(char));
+/*
+Evaluates a regular file mapped into memory, see parus_map_file.
+returns 0 if the file cannot be mapped so it can be streamed instead
+*/
+char evaluate_mapped(ParusVM* vm, char* file_name) {
+	size_t 	size;
+	char* 	text = parus_map_file(file_name, &size);
 
-	int c = 0;
-	while ((c = fgetc(f)) != EOF) {
-		if (size != max - 1) 
-			text[size++] = c;
-		else {
-			text = realloc(text, (max + TEXT_BUFFER_SIZE) * sizeof(char));
-			if (text != 0) {
-				max += TEXT_BUFFER_SIZE;
-				text[size++] = c;
-			}
-		}
-	}
+	if (text == NULL)
+		return 0;
 
-	return text;
+	madvise(text, size, MADV_SEQUENTIAL);
+	parus_evaluate(vm, text, size);
+	munmap(text, size);
+
+	return 1;
 }
 
 char* repl_read() {
@@ -112,11 +113,85 @@ char* repl_read() {
 
 }
 
+/* Prints the output of a batch job after a comment with its name and timing */
+void print_job(ParusJob* job, size_t index, void* arg) {
+	printf("; %s %.3f ms\n", job->path, job->seconds * 1000);
+	if (job->output != NULL)
+		fwrite(job->output, 1, job->output_size, stdout);
+
+	// diagnostics go to stderr under the name of their job
+	if (job->errors != NULL && job->errors_size > 0) {
+		fflush(stdout);
+		fprintf(stderr, "; %s\n", job->path);
+		fwrite(job->errors, 1, job->errors_size, stderr);
+	}
+
+	free(job->output);
+	free(job->errors);
+	job->output = NULL;
+	job->errors = NULL;
+}
+
+/* Runs every script given as a job, or every path read from the standard input when none is given */
+int run_batch(ParusBatch* batch, char** paths, int count) {
+	ParusJob* 	jobs 	= NULL;
+	size_t 		size 	= 0;
+	char 		line[TEXT_BUFFER_SIZE];
+
+	if (count > 0) {
+		jobs = calloc(count, sizeof(ParusJob));
+		for (; jobs != NULL && size < count; size++)
+			jobs[size].path = paths[size];
+	}
+	else {
+		size_t max = 0;
+		while (fgets(line, TEXT_BUFFER_SIZE, stdin) != NULL) {
+			line[strcspn(line, "\n")] = '\0';
+			if (line[0] == '\0')
+				continue;
+
+			if (size == max) {
+				max 			= max == 0 ? 64 : max * 2;
+				ParusJob* grown = realloc(jobs, max * sizeof(ParusJob));
+				if (grown == NULL)
+					break;
+				jobs = grown;
+			}
+
+			memset(&jobs[size], 0, sizeof(ParusJob));
+			jobs[size++].path = strdup(line);
+		}
+	}
+
+	if (jobs == NULL && size > 0) {
+		fprintf(stderr, "CANNOT ALLOCATE JOBS\n");
+		return EXIT_FAILURE;
+	}
+
+	batch->done = &print_job;
+	int e = parus_batch(batch, jobs, size);
+
+	if (count == 0)
+		for (size_t i = 0; i < size; i++)
+			free(jobs[i].path);
+	free(jobs);
+
+	return e ? EXIT_FAILURE : 0;
+}
+
 int main(int argc, char** argv) {
 	char 	norepl 		= 0;
 	char 	help 		= 0;
 	char 	notitle 	= 0;
 	char* 	file_name 	= NULL;
+	char* 	image_name 	= NULL;
+	char* 	save_name 	= NULL;
+	size_t 	frames_mb 	= 0; // 0 keeps the default limit
+
+	ParusBatch 	batch 		= { .workers = 1 };
+	char 		batched 	= 0;
+	char** 		jobs 		= malloc(argc * sizeof(char*)); // every script is a job in batch mode
+	int 		job_count 	= 0;
 
 	for (int i = 1; i < argc; i++) {
 		if (strcmp(argv[i], "-norepl") == 0)
@@ -125,8 +200,24 @@ int main(int argc, char** argv) {
 			help = 1;
 		else if (strcmp(argv[i], "-notitle") == 0)
 			notitle = 1;
-		else if (file_name == NULL)
-			file_name = argv[i];
+		else if (strcmp(argv[i], "-image") == 0 && i +1 < argc)
+			image_name = argv[++i];
+		else if (strcmp(argv[i], "-save-image") == 0 && i +1 < argc)
+			save_name = argv[++i];
+		else if (strcmp(argv[i], "-frames") == 0 && i +1 < argc)
+			frames_mb = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-batch") == 0)
+			batched = 1;
+		else if (strcmp(argv[i], "-j") == 0 && i +1 < argc)
+			batch.workers = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-prelude") == 0 && i +1 < argc)
+			batch.prelude = argv[++i];
+		else {
+			if (file_name == NULL)
+				file_name = argv[i];
+			if (jobs != NULL)
+				jobs[job_count++] = argv[i];
+		}
 
 	}
 
@@ -137,20 +228,46 @@ int main(int argc, char** argv) {
 		return 0;
 	}
 
-	Stack*		stk = make_stack();
-	Lexicon* 	lex = predefined_lexicon();
+	if (batched) {
+		batch.image = image_name;
+		int e = run_batch(&batch, jobs, job_count);
+		free(jobs);
+		return e;
+	}
+	free(jobs);
+
+	ParusVM* vm = make_parus_vm(predefined_lexicon());
+	if (vm == NULL)
+		return EXIT_FAILURE;
+
+	if (frames_mb > 0)
+		vm->frames_limit = frames_mb * 1024 * 1024;
+
+	// the image replaces the predefined lexicon, which is still made to set up the interpreter
+	if (image_name != NULL)
+		parus_load_image(vm, image_name);
 
 	if (file_name != NULL) {
-		FILE* f = fopen(file_name, "r");
-		if (f != NULL) {
-			char* text = read_file(f);
-			parus_evaluate(text, stk, lex);
-			free(text);
+		// - reads the program from the standard input, other pipes and devices are streamed as well
+		FILE* f = strcmp(file_name, "-") == 0 ? stdin : NULL;
+
+		if (f == stdin || !evaluate_mapped(vm, file_name)) {
+			if (f == NULL)
+				f = fopen(file_name, "r");
+
+			if (f != NULL) {
+				parus_evaluate_file(vm, f);
+				if (f != stdin)
+					fclose(f);
+			}
+			else
+				fprintf(stderr, "CANNOT OPEN FILE %s\nMAKE SURE THAT THE FILE EXISTS\n", file_name);
 		}
-		else
-			fprintf(stderr, "CANNOT OPEN FILE %s\nMAKE SURE THAT THE FILE EXISTS\n", file_name);
 	}
 
+	if (save_name != NULL)
+		parus_save_image(vm, save_name);
+
 	if (!norepl && !notitle) 
 		printf(TITLE_MESSAGE);
 
@@ -161,13 +278,12 @@ int main(int argc, char** argv) {
 		if (input == NULL)
 			break;
 
-		parus_evaluate(input, stk, lex);
+		parus_evaluate(vm, input, strlen(input));
 		
 		free(input);
 	}
 
-	free_stack(stk);
-	free_lexicon(lex);
+	free_parus_vm(vm);
 
 	return 0;
 }